@@ -22,41 +22,174 @@
 #define PCIEMU_HW_DEVICE_ID 0x1100
 #define PCIEMU_HW_REVISION 0x01
 
-/* BAR */
+/* BAR
+ *  - BAR0 : registers (MMIO, must be mapped uncached)
+ *  - BAR1 : device memory, i.e. the DMA area (prefetchable, may be mapped
+ *           write-combining). Offset 0 of BAR1 is PCIEMU_HW_DMA_AREA_START.
+ */
 #define PCIEMU_HW_BAR0 0
-#define PCIEMU_HW_BAR_CNT 1
+#define PCIEMU_HW_BAR1 1
+#define PCIEMU_HW_BAR_CNT 2
+
+/* MMIO - BAR0 layout
+ *
+ * BAR0 is split in function blocks, each one on its own page so that they
+ * can be handled (and mapped) independently:
+ *   - page 0 : general purpose registers (plain storage, RAM backed in QEMU)
+ *   - page 1 : IRQ
+ *   - page 2 : DMA configuration
+ *   - page 3 : DMA doorbell (hot path, backed by an ioeventfd in QEMU)
+ */
+#define PCIEMU_HW_BAR0_PAGE_SIZE 0x1000
+#define PCIEMU_HW_BAR0_PAGE_REGS 0
+#define PCIEMU_HW_BAR0_PAGE_IRQ 1
+#define PCIEMU_HW_BAR0_PAGE_DMA_CFG 2
+#define PCIEMU_HW_BAR0_PAGE_DOORBELL 3
+#define PCIEMU_HW_BAR0_PAGE_CNT 4
+#define PCIEMU_HW_BAR0_SIZE (PCIEMU_HW_BAR0_PAGE_CNT * PCIEMU_HW_BAR0_PAGE_SIZE)
+#define PCIEMU_HW_BAR0_PAGE(n) ((n) * PCIEMU_HW_BAR0_PAGE_SIZE)
 
 /* MMIO - HARDWARE REGISTERS */
 #define PCIEMU_HW_BAR0_REG_CNT 4
-#define PCIEMU_HW_BAR0_REG_0 0x00
-#define PCIEMU_HW_BAR0_REG_1 0x08
-#define PCIEMU_HW_BAR0_REG_2 0x10
-#define PCIEMU_HW_BAR0_REG_3 0x18
+#define PCIEMU_HW_BAR0_REG_0 \
+	(PCIEMU_HW_BAR0_PAGE(PCIEMU_HW_BAR0_PAGE_REGS) + 0x00)
+#define PCIEMU_HW_BAR0_REG_1 \
+	(PCIEMU_HW_BAR0_PAGE(PCIEMU_HW_BAR0_PAGE_REGS) + 0x08)
+#define PCIEMU_HW_BAR0_REG_2 \
+	(PCIEMU_HW_BAR0_PAGE(PCIEMU_HW_BAR0_PAGE_REGS) + 0x10)
+#define PCIEMU_HW_BAR0_REG_3 \
+	(PCIEMU_HW_BAR0_PAGE(PCIEMU_HW_BAR0_PAGE_REGS) + 0x18)
 
 /* MMIO - IRQ */
-#define PCIEMU_HW_BAR0_IRQ_0_RAISE 0x20
-#define PCIEMU_HW_BAR0_IRQ_0_LOWER 0x28
+#define PCIEMU_HW_BAR0_IRQ_0_RAISE \
+	(PCIEMU_HW_BAR0_PAGE(PCIEMU_HW_BAR0_PAGE_IRQ) + 0x00)
+#define PCIEMU_HW_BAR0_IRQ_0_LOWER \
+	(PCIEMU_HW_BAR0_PAGE(PCIEMU_HW_BAR0_PAGE_IRQ) + 0x08)
 
 /* MMIO - DMA configuration */
-#define PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC 0x30
-#define PCIEMU_HW_BAR0_DMA_CFG_TXDESC_DST 0x38
-#define PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN 0x40
-#define PCIEMU_HW_BAR0_DMA_CFG_CMD 0x48
-#define PCIEMU_HW_BAR0_DMA_DOORBELL_RING 0x50
+#define PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC \
+	(PCIEMU_HW_BAR0_PAGE(PCIEMU_HW_BAR0_PAGE_DMA_CFG) + 0x00)
+#define PCIEMU_HW_BAR0_DMA_CFG_TXDESC_DST \
+	(PCIEMU_HW_BAR0_PAGE(PCIEMU_HW_BAR0_PAGE_DMA_CFG) + 0x08)
+#define PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN \
+	(PCIEMU_HW_BAR0_PAGE(PCIEMU_HW_BAR0_PAGE_DMA_CFG) + 0x10)
+#define PCIEMU_HW_BAR0_DMA_CFG_CMD \
+	(PCIEMU_HW_BAR0_PAGE(PCIEMU_HW_BAR0_PAGE_DMA_CFG) + 0x18)
+#define PCIEMU_HW_BAR0_DMA_RESULT \
+	(PCIEMU_HW_BAR0_PAGE(PCIEMU_HW_BAR0_PAGE_DMA_CFG) + 0x20)
+#define PCIEMU_HW_BAR0_DMA_STATUS \
+	(PCIEMU_HW_BAR0_PAGE(PCIEMU_HW_BAR0_PAGE_DMA_CFG) + 0x28)
+
+/* MMIO - DMA doorbell */
+#define PCIEMU_HW_BAR0_DMA_DOORBELL_RING \
+	(PCIEMU_HW_BAR0_PAGE(PCIEMU_HW_BAR0_PAGE_DOORBELL) + 0x00)
 
 /* MMIO BAR0 Boundaries */
 #define PCIEMU_HW_BAR0_START PCIEMU_HW_BAR0_REG_0
 #define PCIEMU_HW_BAR0_END PCIEMU_HW_BAR0_DMA_DOORBELL_RING
 
+/* MMIO - Register map
+ *
+ * Every register is PCIEMU_HW_REG_WIDTH bytes wide and naturally aligned.
+ * It can be accessed with a single 64-bit access or as two 32-bit halves
+ * (low half first when programming addresses, e.g. lo_hi_writeq()).
+ * Each page holds at most PCIEMU_HW_BAR0_PAGE_SLOTS registers, so BAR0 is
+ * made of PCIEMU_HW_BAR0_REG_SLOTS register slots, PCIEMU_HW_REG_SLOT()
+ * giving the slot of a register offset.
+ * PCIEMU_HW_BAR0_REGS(X) expands X(name, offset, width, access, reset)
+ * once per register: it is the single description of BAR0 from which the
+ * device model (and anyone else needing it) builds its register tables.
+ *   - access : PCIEMU_HW_REG_RO, PCIEMU_HW_REG_WO or PCIEMU_HW_REG_RW
+ *   - reset  : value of a RW register after a device reset
+ */
+#define PCIEMU_HW_REG_WIDTH 8
+#define PCIEMU_HW_BAR0_PAGE_SLOTS 8
+#define PCIEMU_HW_BAR0_REG_SLOTS \
+	(PCIEMU_HW_BAR0_PAGE_CNT * PCIEMU_HW_BAR0_PAGE_SLOTS)
+#define PCIEMU_HW_REG_SLOT(offset) \
+	((offset) / PCIEMU_HW_BAR0_PAGE_SIZE * PCIEMU_HW_BAR0_PAGE_SLOTS + \
+	 (offset) % PCIEMU_HW_BAR0_PAGE_SIZE / PCIEMU_HW_REG_WIDTH)
+
+#define PCIEMU_HW_REG_RD 0x1
+#define PCIEMU_HW_REG_WR 0x2
+#define PCIEMU_HW_REG_RO PCIEMU_HW_REG_RD
+#define PCIEMU_HW_REG_WO PCIEMU_HW_REG_WR
+#define PCIEMU_HW_REG_RW (PCIEMU_HW_REG_RD | PCIEMU_HW_REG_WR)
+
+#define PCIEMU_HW_BAR0_REGS(X) \
+	X(REG_0, PCIEMU_HW_BAR0_REG_0, 8, PCIEMU_HW_REG_RW, 0) \
+	X(REG_1, PCIEMU_HW_BAR0_REG_1, 8, PCIEMU_HW_REG_RW, 0) \
+	X(REG_2, PCIEMU_HW_BAR0_REG_2, 8, PCIEMU_HW_REG_RW, 0) \
+	X(REG_3, PCIEMU_HW_BAR0_REG_3, 8, PCIEMU_HW_REG_RW, 0) \
+	X(IRQ_0_RAISE, PCIEMU_HW_BAR0_IRQ_0_RAISE, 8, PCIEMU_HW_REG_WO, 0) \
+	X(IRQ_0_LOWER, PCIEMU_HW_BAR0_IRQ_0_LOWER, 8, PCIEMU_HW_REG_WO, 0) \
+	X(DMA_CFG_TXDESC_SRC, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC, 8, \
+			PCIEMU_HW_REG_RW, 0) \
+	X(DMA_CFG_TXDESC_DST, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_DST, 8, \
+			PCIEMU_HW_REG_RW, 0) \
+	X(DMA_CFG_TXDESC_LEN, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN, 8, \
+			PCIEMU_HW_REG_RW, 0) \
+	X(DMA_CFG_CMD, PCIEMU_HW_BAR0_DMA_CFG_CMD, 8, PCIEMU_HW_REG_RW, 0) \
+	X(DMA_RESULT, PCIEMU_HW_BAR0_DMA_RESULT, 8, PCIEMU_HW_REG_RO, 0) \
+	X(DMA_STATUS, PCIEMU_HW_BAR0_DMA_STATUS, 8, PCIEMU_HW_REG_RO, 0) \
+	X(DMA_DOORBELL_RING, PCIEMU_HW_BAR0_DMA_DOORBELL_RING, 8, \
+			PCIEMU_HW_REG_WO, 0)
+
 /* DMA */
-#define PCIEMU_HW_DMA_ADDR_CAPABILITY 32
+#define PCIEMU_HW_DMA_ADDR_CAPABILITY 64
 #define PCIEMU_HW_DMA_AREA_START 0x10000
 #define PCIEMU_HW_DMA_AREA_SIZE 0x1000 //0x400000 // 4MB
 
+/* DMA channels: each channel has its own completion vector. The engine
+ * currently implements a single channel behind the BAR0 DMA registers.
+ */
+#define PCIEMU_HW_DMA_CHAN_CNT 1
+
 /* DMA Commands expliciting direction of transfer */
 #define PCIEMU_HW_DMA_DIRECTION_TO_DEVICE 0x1
 #define PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE 0x2
 
+/* DMA offload commands, executed directly between bus addresses
+ *  - COPY    : copy LEN bytes from SRC to DST
+ *  - FILL    : fill LEN bytes at DST with the 64-bit pattern held in SRC
+ *  - COMPARE : compare LEN bytes at SRC and DST
+ * LEN is limited to PCIEMU_HW_DMA_OFFLOAD_MAX_LEN.
+ */
+#define PCIEMU_HW_DMA_CMD_COPY 0x3
+#define PCIEMU_HW_DMA_CMD_FILL 0x4
+#define PCIEMU_HW_DMA_CMD_COMPARE 0x5
+#define PCIEMU_HW_DMA_OFFLOAD_MAX_LEN 0x100000
+
+/* DMA compute commands, executed on the device memory [SRC, SRC + LEN)
+ *  - CRC32C : CRC-32C (Castagnoli) of the data
+ *  - CSUM   : Internet checksum (RFC 1071), in network byte order
+ *  - XOR    : XOR of all 64-bit little endian words (parity block)
+ *  - SUM    : sum of all bytes
+ * The value is reported in DMA_RESULT and may be any 64-bit value (a XOR
+ * can equal PCIEMU_HW_DMA_RESULT_ERROR): failures are told by DMA_STATUS.
+ */
+#define PCIEMU_HW_DMA_CMD_CRC32C 0x6
+#define PCIEMU_HW_DMA_CMD_CSUM 0x7
+#define PCIEMU_HW_DMA_CMD_XOR 0x8
+#define PCIEMU_HW_DMA_CMD_SUM 0x9
+
+/* DMA status register, valid once the completion IRQ is raised
+ *  - PCIEMU_HW_DMA_STATUS_ERROR : the last command failed (bad
+ *                                 configuration or bus error)
+ */
+#define PCIEMU_HW_DMA_STATUS_ERROR 0x1
+
+/* DMA result register, valid once the completion IRQ is raised and only
+ * if DMA_STATUS has no error
+ *  - PCIEMU_HW_DMA_RESULT_OK    : command succeeded (COMPARE: equal)
+ *  - any other value            : COMPARE, offset + 1 of the first
+ *                                 differing byte; compute commands, value
+ * A failed command also leaves PCIEMU_HW_DMA_RESULT_ERROR in DMA_RESULT,
+ * for drivers predating DMA_STATUS.
+ */
+#define PCIEMU_HW_DMA_RESULT_OK 0x0
+#define PCIEMU_HW_DMA_RESULT_ERROR (~0ULL)
+
 /* IRQs */
 #define PCIEMU_HW_IRQ_CNT 1
 #define PCIEMU_HW_IRQ_VECTOR_START 0
@@ -64,9 +197,10 @@
 #define PCIEMU_HW_IRQ_INTX 0 /* INTA */
 
 /* IRQs for DMA */
-/* #define PCIEMU_HW_IRQ_DMA_ENDED_VECTOR 0 */
-/* #define PCIEMU_HW_IRQ_DMA_ENDED_ADDR PCIEMU_HW_BAR0_IRQ_0_RAISE */
-/* #define PCIEMU_HW_IRQ_DMA_ACK_ADDR PCIEMU_HW_BAR0_IRQ_0_LOWER */
+/* Channel n signals completion on vector PCIEMU_HW_IRQ_DMA_ENDED_VECTOR + n */
+#define PCIEMU_HW_IRQ_DMA_ENDED_VECTOR 0
+#define PCIEMU_HW_IRQ_DMA_ENDED_ADDR PCIEMU_HW_BAR0_IRQ_0_RAISE
+#define PCIEMU_HW_IRQ_DMA_ACK_ADDR PCIEMU_HW_BAR0_IRQ_0_LOWER
 
 /* IRQs for work */
 #define PCIEMU_HW_IRQ_FINI 0
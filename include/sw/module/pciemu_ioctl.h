@@ -14,4 +14,19 @@
 #define PCIEMU_IOCTL_DMA_TO_DEVICE _IOW(PCIEMU_IOCTL_MAGIC, 1, void *)
 #define PCIEMU_IOCTL_DMA_FROM_DEVICE _IOR(PCIEMU_IOCTL_MAGIC, 2, void *)
 
+/* Bind an eventfd to a DMA completion vector (one per submission queue).
+ * The eventfd is signaled each time a DMA completes on that vector.
+ * A negative fd unbinds the vector, PCIEMU_IOCTL_VECTOR_ALL selects every
+ * completion vector of the device.
+ */
+struct pciemu_ioctl_eventfd {
+	int fd;
+	unsigned int vector;
+};
+
+#define PCIEMU_IOCTL_VECTOR_ALL (~0U)
+
+#define PCIEMU_IOCTL_EVENTFD_BIND \
+	_IOW(PCIEMU_IOCTL_MAGIC, 3, struct pciemu_ioctl_eventfd)
+
 #endif /* _PCIEMU_IOCTL_H_ */
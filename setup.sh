@@ -19,6 +19,18 @@ REPOSITORY_NAME=$(basename $REPOSITORY_DIR)
 echo "source $REPOSITORY_NAME/Kconfig" >> qemu/hw/misc/Kconfig
 echo "subdir('$REPOSITORY_NAME')" >> qemu/hw/misc/meson.build
 
+# Register the device trace-events (generates trace/trace-hw_misc_pciemu.h)
+sed -i "s|'hw/misc/macio',|'hw/misc/macio',\n    'hw/misc/$REPOSITORY_NAME',|" qemu/meson.build
+
+# Register the query-pciemu QMP command
+ln -s $REPOSITORY_DIR/src/hw/$REPOSITORY_NAME/pciemu.json $REPOSITORY_DIR/qemu/qapi/pciemu.json
+sed -i "s|{ 'include': 'pci.json' }|{ 'include': 'pci.json' }\n{ 'include': 'pciemu.json' }|" qemu/qapi/qapi-schema.json
+sed -i "s|^  'pci',|  'pci',\n  'pciemu',|" qemu/qapi/meson.build
+
+# Register the "info pciemu" HMP command
+cat src/hw/$REPOSITORY_NAME/hmp-commands-info.hx >> qemu/hmp-commands-info.hx
+sed -i '$ i void hmp_info_pciemu(Monitor *mon, const QDict *qdict);' qemu/include/monitor/hmp.h
+
 # Create symbolic links to device files
 ln -s $REPOSITORY_DIR/src/hw/$REPOSITORY_NAME/ $REPOSITORY_DIR/qemu/hw/misc/
 
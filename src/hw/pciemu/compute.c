@@ -0,0 +1,309 @@
+/* compute.c - In-device compute kernels
+ *
+ *   - CRC32C   : CRC-32C (Castagnoli) of the buffer
+ *   - CSUM     : Internet checksum (RFC 1071) of the buffer, i.e. the value
+ *                to be stored big endian in a protocol header
+ *   - XOR      : XOR of all 64-bit little endian words (last one zero padded)
+ *   - SUM      : sum of all bytes
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/crc32c.h"
+#include "compute.h"
+#include "pciemu_hw.h"
+
+#if defined(CONFIG_AVX2_OPT) && defined(__x86_64__)
+#include "host/cpuinfo.h"
+#include <immintrin.h>
+#define PCIEMU_COMPUTE_AVX2
+#elif defined(__aarch64__) && !HOST_BIG_ENDIAN
+#include <arm_neon.h>
+#ifdef __ARM_FEATURE_CRC32
+#include <arm_acle.h>
+#endif
+#define PCIEMU_COMPUTE_NEON
+#endif
+
+/* -----------------------------------------------------------------------------
+ *  Private
+ * -----------------------------------------------------------------------------
+ */
+
+typedef uint64_t (*PCIEMUComputeFn)(const uint8_t *buf, size_t len);
+
+/* set of kernels for a given ISA */
+typedef struct PCIEMUComputeImpl {
+	const char *name;
+	PCIEMUComputeFn crc32c;
+	PCIEMUComputeFn csum;
+	PCIEMUComputeFn xor;
+	PCIEMUComputeFn sum;
+} PCIEMUComputeImpl;
+
+/*
+ * Generic kernels, also used on the tail the SIMD kernels leave behind
+ */
+
+static uint64_t pciemu_compute_crc32c_generic(const uint8_t *buf, size_t len)
+{
+	return crc32c(0xffffffff, buf, len);
+}
+
+/* ones' complement sum of 16-bit little endian words (not folded) */
+static uint64_t pciemu_compute_csum_add(const uint8_t *buf, size_t len)
+{
+	uint64_t sum = 0;
+
+	for (; len >= 2; buf += 2, len -= 2)
+		sum += lduw_le_p(buf);
+	if (len)
+		sum += *buf;
+	return sum;
+}
+
+/* fold the sum and turn it into the big endian Internet checksum */
+static uint64_t pciemu_compute_csum_finish(uint64_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	/* summing little endian words gives the byte swapped sum (RFC 1071) */
+	return (uint16_t)~bswap16(sum);
+}
+
+static uint64_t pciemu_compute_csum_generic(const uint8_t *buf, size_t len)
+{
+	return pciemu_compute_csum_finish(pciemu_compute_csum_add(buf, len));
+}
+
+static uint64_t pciemu_compute_xor_generic(const uint8_t *buf, size_t len)
+{
+	uint64_t x = 0, tail = 0;
+
+	for (; len >= 8; buf += 8, len -= 8)
+		x ^= ldq_le_p(buf);
+	for (size_t i = 0; i < len; ++i)
+		tail |= (uint64_t)buf[i] << (i * 8);
+	return x ^ tail;
+}
+
+static uint64_t pciemu_compute_sum_generic(const uint8_t *buf, size_t len)
+{
+	uint64_t sum = 0;
+
+	while (len--)
+		sum += *buf++;
+	return sum;
+}
+
+static const PCIEMUComputeImpl pciemu_compute_generic = {
+	.name = "generic",
+	.crc32c = pciemu_compute_crc32c_generic,
+	.csum = pciemu_compute_csum_generic,
+	.xor = pciemu_compute_xor_generic,
+	.sum = pciemu_compute_sum_generic,
+};
+
+#ifdef PCIEMU_COMPUTE_AVX2
+/*
+ * x86_64 kernels: AVX2 (every AVX2 host also has the SSE4.2 crc32)
+ */
+
+static uint64_t __attribute__((target("sse4.2")))
+pciemu_compute_crc32c_sse42(const uint8_t *buf, size_t len)
+{
+	uint64_t crc = 0xffffffff;
+
+	for (; len >= 8; buf += 8, len -= 8)
+		crc = _mm_crc32_u64(crc, ldq_he_p(buf));
+	for (; len; ++buf, --len)
+		crc = _mm_crc32_u8(crc, *buf);
+	return (uint32_t)~crc;
+}
+
+static uint64_t __attribute__((target("avx2")))
+pciemu_compute_hsum_avx2(__m256i v)
+{
+	uint64_t lanes[4];
+
+	_mm256_storeu_si256((__m256i *)lanes, v);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+static uint64_t __attribute__((target("avx2")))
+pciemu_compute_csum_avx2(const uint8_t *buf, size_t len)
+{
+	const __m256i mask = _mm256_set1_epi32(0xffff);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = zero, v, w;
+
+	for (; len >= 32; buf += 32, len -= 32) {
+		v = _mm256_loadu_si256((const __m256i *)buf);
+		/* 16 words -> 8 pair sums (32 bits) -> accumulated in 64 bits */
+		w = _mm256_add_epi32(_mm256_and_si256(v, mask),
+				_mm256_srli_epi32(v, 16));
+		acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(w, zero));
+		acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(w, zero));
+	}
+
+	return pciemu_compute_csum_finish(pciemu_compute_hsum_avx2(acc) +
+			pciemu_compute_csum_add(buf, len));
+}
+
+static uint64_t __attribute__((target("avx2")))
+pciemu_compute_xor_avx2(const uint8_t *buf, size_t len)
+{
+	__m256i acc = _mm256_setzero_si256();
+	uint64_t lanes[4];
+
+	for (; len >= 32; buf += 32, len -= 32)
+		acc = _mm256_xor_si256(acc,
+				_mm256_loadu_si256((const __m256i *)buf));
+
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	return lanes[0] ^ lanes[1] ^ lanes[2] ^ lanes[3] ^
+		pciemu_compute_xor_generic(buf, len);
+}
+
+static uint64_t __attribute__((target("avx2")))
+pciemu_compute_sum_avx2(const uint8_t *buf, size_t len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = zero;
+
+	/* sad against zero: sums of 8 bytes in each 64-bit lane */
+	for (; len >= 32; buf += 32, len -= 32)
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(
+				_mm256_loadu_si256((const __m256i *)buf), zero));
+
+	return pciemu_compute_hsum_avx2(acc) +
+		pciemu_compute_sum_generic(buf, len);
+}
+
+static const PCIEMUComputeImpl pciemu_compute_avx2 = {
+	.name = "avx2",
+	.crc32c = pciemu_compute_crc32c_sse42,
+	.csum = pciemu_compute_csum_avx2,
+	.xor = pciemu_compute_xor_avx2,
+	.sum = pciemu_compute_sum_avx2,
+};
+#endif /* PCIEMU_COMPUTE_AVX2 */
+
+#ifdef PCIEMU_COMPUTE_NEON
+/*
+ * aarch64 kernels: NEON is part of the base ISA, the CRC32 instructions
+ * are used when the compiler targets them.
+ */
+
+#ifdef __ARM_FEATURE_CRC32
+static uint64_t pciemu_compute_crc32c_neon(const uint8_t *buf, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+
+	for (; len >= 8; buf += 8, len -= 8)
+		crc = __crc32cd(crc, ldq_he_p(buf));
+	for (; len; ++buf, --len)
+		crc = __crc32cb(crc, *buf);
+	return (uint32_t)~crc;
+}
+#else
+#define pciemu_compute_crc32c_neon pciemu_compute_crc32c_generic
+#endif
+
+static uint64_t pciemu_compute_csum_neon(const uint8_t *buf, size_t len)
+{
+	uint64x2_t acc = vdupq_n_u64(0);
+
+	/* 8 words -> 4 pair sums (32 bits) -> accumulated in 64 bits */
+	for (; len >= 16; buf += 16, len -= 16)
+		acc = vpadalq_u32(acc, vpaddlq_u16(
+				vreinterpretq_u16_u8(vld1q_u8(buf))));
+
+	return pciemu_compute_csum_finish(vaddvq_u64(acc) +
+			pciemu_compute_csum_add(buf, len));
+}
+
+static uint64_t pciemu_compute_xor_neon(const uint8_t *buf, size_t len)
+{
+	uint64x2_t acc = vdupq_n_u64(0);
+
+	for (; len >= 16; buf += 16, len -= 16)
+		acc = veorq_u64(acc, vreinterpretq_u64_u8(vld1q_u8(buf)));
+
+	return vgetq_lane_u64(acc, 0) ^ vgetq_lane_u64(acc, 1) ^
+		pciemu_compute_xor_generic(buf, len);
+}
+
+static uint64_t pciemu_compute_sum_neon(const uint8_t *buf, size_t len)
+{
+	uint64x2_t acc = vdupq_n_u64(0);
+
+	for (; len >= 16; buf += 16, len -= 16)
+		acc = vpadalq_u32(acc, vpaddlq_u16(vpaddlq_u8(vld1q_u8(buf))));
+
+	return vaddvq_u64(acc) + pciemu_compute_sum_generic(buf, len);
+}
+
+static const PCIEMUComputeImpl pciemu_compute_neon = {
+	.name = "neon",
+	.crc32c = pciemu_compute_crc32c_neon,
+	.csum = pciemu_compute_csum_neon,
+	.xor = pciemu_compute_xor_neon,
+	.sum = pciemu_compute_sum_neon,
+};
+#endif /* PCIEMU_COMPUTE_NEON */
+
+/* kernels in use, selected at startup */
+static const PCIEMUComputeImpl *pciemu_compute_impl = &pciemu_compute_generic;
+
+static void __attribute__((constructor)) pciemu_compute_select(void)
+{
+#if defined(PCIEMU_COMPUTE_AVX2)
+	if (cpuinfo_init() & CPUINFO_AVX2)
+		pciemu_compute_impl = &pciemu_compute_avx2;
+#elif defined(PCIEMU_COMPUTE_NEON)
+	pciemu_compute_impl = &pciemu_compute_neon;
+#endif
+}
+
+/* -----------------------------------------------------------------------------
+ *  Public
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_compute: Run a compute command on a buffer
+ *
+ * @cmd: compute command (PCIEMU_HW_DMA_CMD_CRC32C/CSUM/XOR/SUM)
+ * @buf: data to process
+ * @len: length of the data
+ *
+ * Returns the value of the command.
+ */
+uint64_t pciemu_compute(dma_cmd_t cmd, const uint8_t *buf, size_t len)
+{
+	switch (cmd) {
+	case PCIEMU_HW_DMA_CMD_CRC32C:
+		return pciemu_compute_impl->crc32c(buf, len);
+	case PCIEMU_HW_DMA_CMD_CSUM:
+		return pciemu_compute_impl->csum(buf, len);
+	case PCIEMU_HW_DMA_CMD_XOR:
+		return pciemu_compute_impl->xor(buf, len);
+	case PCIEMU_HW_DMA_CMD_SUM:
+	default:
+		return pciemu_compute_impl->sum(buf, len);
+	}
+}
+
+/**
+ * pciemu_compute_impl_name: Name of the kernels in use (generic, avx2, neon)
+ */
+const char *pciemu_compute_impl_name(void)
+{
+	return pciemu_compute_impl->name;
+}
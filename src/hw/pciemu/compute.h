@@ -0,0 +1,27 @@
+/* compute.h - In-device compute kernels
+ *
+ * Compute commands (PCIEMU_HW_DMA_CMD_CRC32C, _CSUM, _XOR, _SUM) process
+ * LEN bytes of the device memory starting at SRC, typically filled by a
+ * previous TO_DEVICE transfer, and report their value in DMA_RESULT.
+ *
+ * Each kernel has a generic C version and SIMD versions (AVX2/SSE4.2 on
+ * x86_64, NEON on aarch64) selected once, at startup, from the host CPU
+ * features.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_COMPUTE_H
+#define PCIEMU_COMPUTE_H
+
+#include "qemu/osdep.h"
+#include "dma.h"
+
+uint64_t pciemu_compute(dma_cmd_t cmd, const uint8_t *buf, size_t len);
+
+const char *pciemu_compute_impl_name(void);
+
+#endif /* PCIEMU_COMPUTE_H */
@@ -6,12 +6,21 @@
  *
  */
 
+#include "compute.h"
 #include "dma.h"
+#include "exec/target_page.h"
 #include "irq.h"
+#include "migration/vmstate.h"
+#include "qapi/error.h"
 #include "pciemu.h"
 #include "proxy.h"
+#include "qemu/bitops.h"
 #include "qemu/log.h"
 #include "qemu/osdep.h"
+#include "sysemu/dma.h"
+#include "trace.h"
+
+#include <sys/mman.h>
 
 /* -----------------------------------------------------------------------------
  *  Private
@@ -37,14 +46,322 @@ static inline dma_addr_t pciemu_dma_addr_mask(PCIEMUDevice *dev,
 }
 
 /**
- * pciemu_dma_inside_device_boundaries: Check if addr is inside boundaries
+ * pciemu_dma_inside_device_boundaries: Check if a range is inside boundaries
  *
  * @addr: Address to be checked (address in device address space)
+ * @len: length of the range starting at addr
  */
-static inline bool pciemu_dma_inside_device_boundaries(dma_addr_t addr)
+static inline bool pciemu_dma_inside_device_boundaries(dma_addr_t addr,
+		dma_size_t len)
 {
 	return (PCIEMU_HW_DMA_AREA_START <= addr &&
-		addr <= PCIEMU_HW_DMA_AREA_START + PCIEMU_HW_DMA_AREA_SIZE);
+		len <= PCIEMU_HW_DMA_AREA_SIZE &&
+		addr - PCIEMU_HW_DMA_AREA_START <= PCIEMU_HW_DMA_AREA_SIZE - len);
+}
+
+/**
+ * PCIEMUDmaChunkFn: Callback of pciemu_dma_walk
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @ptr: host pointer to the chunk
+ * @ofs: offset of the chunk inside the walked range
+ * @len: length of the chunk
+ * @opaque: walker data
+ *
+ * Returns false to stop the walk.
+ */
+typedef bool (*PCIEMUDmaChunkFn)(PCIEMUDevice *dev, uint8_t *ptr,
+		dma_addr_t ofs, dma_addr_t len, void *opaque);
+
+/* size of the bounce buffer used when bus memory cannot be mapped */
+#define PCIEMU_DMA_BOUNCE_SIZE 0x1000
+
+/**
+ * pciemu_dma_walk: Walk a range of bus memory through host pointers
+ *
+ * Contiguous guest RAM is mapped directly (pci_dma_map), so each chunk is
+ * accessed in place with no intermediate copy and no per-page lookup.
+ * Ranges that cannot be mapped (e.g. MMIO of another device while QEMU's
+ * own bounce buffer is busy) fall back to pci_dma_read/pci_dma_write
+ * through a small bounce buffer.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @addr: bus address of the range
+ * @len: length of the range
+ * @dir: DMA_DIRECTION_TO_DEVICE to read the range, FROM_DEVICE to write it
+ * @fn: called on each chunk (reads or fills it)
+ * @opaque: passed to fn
+ *
+ * Returns 0 on success (even if fn stopped the walk), -1 on bus error.
+ */
+static int pciemu_dma_walk(PCIEMUDevice *dev, dma_addr_t addr, dma_size_t len,
+		DMADirection dir, PCIEMUDmaChunkFn fn, void *opaque)
+{
+	g_autofree uint8_t *bounce = NULL;
+	dma_addr_t ofs = 0, n;
+	uint8_t *ptr;
+	bool more = true;
+
+	addr = pciemu_dma_addr_mask(dev, addr);
+	while (ofs < len && more) {
+		n = len - ofs;
+		ptr = pci_dma_map(&dev->pci_dev, addr + ofs, &n, dir);
+		if (ptr) {
+			more = fn(dev, ptr, ofs, n, opaque);
+			pci_dma_unmap(&dev->pci_dev, ptr, n, dir, n);
+			ofs += n;
+			continue;
+		}
+
+		if (!bounce)
+			bounce = g_malloc(PCIEMU_DMA_BOUNCE_SIZE);
+		n = MIN(len - ofs, PCIEMU_DMA_BOUNCE_SIZE);
+		if (dir == DMA_DIRECTION_TO_DEVICE) {
+			if (pci_dma_read(&dev->pci_dev, addr + ofs, bounce, n))
+				goto bus_error;
+			more = fn(dev, bounce, ofs, n, opaque);
+		} else {
+			more = fn(dev, bounce, ofs, n, opaque);
+			if (pci_dma_write(&dev->pci_dev, addr + ofs, bounce, n))
+				goto bus_error;
+		}
+		ofs += n;
+	}
+
+	return 0;
+
+bus_error:
+	qemu_log_mask(LOG_GUEST_ERROR, "bus error at 0x%" PRIx64 "\n",
+			addr + ofs);
+	return -1;
+}
+
+/* chunk callbacks: copy from/to a host buffer (opaque). COPY passes a
+ * chunk of guest memory as the buffer, which may overlap the chunk */
+static bool pciemu_dma_chunk_read(PCIEMUDevice *dev, uint8_t *ptr,
+		dma_addr_t ofs, dma_addr_t len, void *opaque)
+{
+	memmove((uint8_t *)opaque + ofs, ptr, len);
+	return true;
+}
+
+static bool pciemu_dma_chunk_write(PCIEMUDevice *dev, uint8_t *ptr,
+		dma_addr_t ofs, dma_addr_t len, void *opaque)
+{
+	memmove(ptr, (uint8_t *)opaque + ofs, len);
+	return true;
+}
+
+/* chunk callback of FILL: byte i of the range is byte (i % 8) of pattern */
+static bool pciemu_dma_chunk_fill(PCIEMUDevice *dev, uint8_t *ptr,
+		dma_addr_t ofs, dma_addr_t len, void *opaque)
+{
+	uint64_t pattern = *(uint64_t *)opaque;
+
+	for (dma_addr_t i = 0; i < len; ++i)
+		ptr[i] = pattern >> (((ofs + i) % 8) * BITS_PER_BYTE);
+	return true;
+}
+
+/* state of the COPY and COMPARE walks */
+typedef struct PCIEMUDmaOffload {
+	dma_addr_t dst; /* bus address of the second range */
+	uint8_t *src; /* chunk of the first range being processed */
+	dma_addr_t src_ofs; /* its offset */
+	uint64_t result;
+} PCIEMUDmaOffload;
+
+/* chunk callback of COPY: write the source chunk at the same offset of dst */
+static bool pciemu_dma_chunk_copy(PCIEMUDevice *dev, uint8_t *ptr,
+		dma_addr_t ofs, dma_addr_t len, void *opaque)
+{
+	PCIEMUDmaOffload *op = opaque;
+
+	if (pciemu_dma_walk(dev, op->dst + ofs, len, DMA_DIRECTION_FROM_DEVICE,
+				pciemu_dma_chunk_write, ptr)) {
+		op->result = PCIEMU_HW_DMA_RESULT_ERROR;
+		return false;
+	}
+	return true;
+}
+
+/* compare a chunk of dst against the source chunk being processed */
+static bool pciemu_dma_chunk_cmp(PCIEMUDevice *dev, uint8_t *ptr,
+		dma_addr_t ofs, dma_addr_t len, void *opaque)
+{
+	PCIEMUDmaOffload *op = opaque;
+	uint8_t *src = op->src + ofs;
+
+	if (!memcmp(src, ptr, len))
+		return true;
+
+	for (dma_addr_t i = 0; i < len; ++i) {
+		if (src[i] != ptr[i]) {
+			op->result = op->src_ofs + ofs + i + 1;
+			break;
+		}
+	}
+	return false;
+}
+
+/* chunk callback of COMPARE: compare with the same offset of dst */
+static bool pciemu_dma_chunk_compare(PCIEMUDevice *dev, uint8_t *ptr,
+		dma_addr_t ofs, dma_addr_t len, void *opaque)
+{
+	PCIEMUDmaOffload *op = opaque;
+
+	op->src = ptr;
+	op->src_ofs = ofs;
+	if (pciemu_dma_walk(dev, op->dst + ofs, len, DMA_DIRECTION_TO_DEVICE,
+				pciemu_dma_chunk_cmp, op))
+		op->result = PCIEMU_HW_DMA_RESULT_ERROR;
+	return op->result == PCIEMU_HW_DMA_RESULT_OK;
+}
+
+/**
+ * pciemu_dma_copy: COPY command, copy len bytes from src to dst
+ *
+ * Overlapping ranges are copied as memmove(3) would. With dst below src,
+ * walking forward only overwrites source bytes already copied. With dst
+ * inside the source range, the copy walks backwards one window at a
+ * time, each window being read whole before it is written.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @src: bus address of the source
+ * @dst: bus address of the destination
+ * @len: number of bytes
+ */
+static uint64_t pciemu_dma_copy(PCIEMUDevice *dev, dma_addr_t src,
+		dma_addr_t dst, dma_size_t len)
+{
+	PCIEMUDmaOffload op = { .result = PCIEMU_HW_DMA_RESULT_OK };
+	g_autofree uint8_t *window = NULL;
+	dma_addr_t ofs, n;
+
+	src = pciemu_dma_addr_mask(dev, src);
+	dst = pciemu_dma_addr_mask(dev, dst);
+	if (dst > src && dst - src < len) {
+		window = g_malloc(PCIEMU_DMA_BOUNCE_SIZE);
+		for (ofs = len; ofs > 0; ofs -= n) {
+			n = MIN(ofs, PCIEMU_DMA_BOUNCE_SIZE);
+			if (pciemu_dma_walk(dev, src + ofs - n, n,
+						DMA_DIRECTION_TO_DEVICE,
+						pciemu_dma_chunk_read, window) ||
+					pciemu_dma_walk(dev, dst + ofs - n, n,
+						DMA_DIRECTION_FROM_DEVICE,
+						pciemu_dma_chunk_write, window))
+				return PCIEMU_HW_DMA_RESULT_ERROR;
+		}
+		return PCIEMU_HW_DMA_RESULT_OK;
+	}
+
+	op.dst = dst;
+	if (pciemu_dma_walk(dev, src, len, DMA_DIRECTION_TO_DEVICE,
+				pciemu_dma_chunk_copy, &op))
+		return PCIEMU_HW_DMA_RESULT_ERROR;
+	return op.result;
+}
+
+/**
+ * pciemu_dma_fill: FILL command, repeat a 64-bit pattern over len bytes
+ *
+ * The pattern is laid out in little endian order starting at dst, i.e.
+ * byte i of the destination is byte (i % 8) of the pattern.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @pattern: 64-bit pattern
+ * @dst: bus address of the destination
+ * @len: number of bytes
+ */
+static uint64_t pciemu_dma_fill(PCIEMUDevice *dev, uint64_t pattern,
+		dma_addr_t dst, dma_size_t len)
+{
+	if (pciemu_dma_walk(dev, dst, len, DMA_DIRECTION_FROM_DEVICE,
+				pciemu_dma_chunk_fill, &pattern))
+		return PCIEMU_HW_DMA_RESULT_ERROR;
+	return PCIEMU_HW_DMA_RESULT_OK;
+}
+
+/**
+ * pciemu_dma_compare: COMPARE command, compare len bytes at src and dst
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @src: bus address of the first buffer
+ * @dst: bus address of the second buffer
+ * @len: number of bytes
+ *
+ * Returns PCIEMU_HW_DMA_RESULT_OK if both buffers are equal, the offset + 1
+ * of the first differing byte otherwise.
+ */
+static uint64_t pciemu_dma_compare(PCIEMUDevice *dev, dma_addr_t src,
+		dma_addr_t dst, dma_size_t len)
+{
+	PCIEMUDmaOffload op = { .dst = dst, .result = PCIEMU_HW_DMA_RESULT_OK };
+
+	if (pciemu_dma_walk(dev, src, len, DMA_DIRECTION_TO_DEVICE,
+				pciemu_dma_chunk_compare, &op))
+		return PCIEMU_HW_DMA_RESULT_ERROR;
+	return op.result;
+}
+
+/**
+ * pciemu_dma_offload: Execute an offload command (COPY, FILL, COMPARE)
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static void pciemu_dma_offload(PCIEMUDevice *dev)
+{
+	DMAEngine *dma = &dev->dma;
+	DMATransferDesc *txdesc = &dma->config.txdesc;
+	uint64_t result;
+
+	if (txdesc->len > PCIEMU_HW_DMA_OFFLOAD_MAX_LEN) {
+		qemu_log_mask(LOG_GUEST_ERROR, "offload len %" PRIu64
+				" too big\n", txdesc->len);
+		result = PCIEMU_HW_DMA_RESULT_ERROR;
+	} else if (dma->config.cmd == PCIEMU_HW_DMA_CMD_COPY) {
+		result = pciemu_dma_copy(dev, txdesc->src, txdesc->dst,
+				txdesc->len);
+	} else if (dma->config.cmd == PCIEMU_HW_DMA_CMD_FILL) {
+		result = pciemu_dma_fill(dev, txdesc->src, txdesc->dst,
+				txdesc->len);
+	} else {
+		result = pciemu_dma_compare(dev, txdesc->src, txdesc->dst,
+				txdesc->len);
+	}
+
+	trace_pciemu_dma_offload(dma->config.cmd, txdesc->len, result);
+	/* offload results (COMPARE offsets) never reach the error value */
+	dma->error = result == PCIEMU_HW_DMA_RESULT_ERROR;
+	pciemu_stats_dma(dev, dma->config.cmd, txdesc->len, dma->error);
+	dma->result = result;
+}
+
+/**
+ * pciemu_dma_compute: Execute a compute command on the device memory
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static void pciemu_dma_compute(PCIEMUDevice *dev)
+{
+	DMAEngine *dma = &dev->dma;
+	DMATransferDesc *txdesc = &dma->config.txdesc;
+	uint64_t result = PCIEMU_HW_DMA_RESULT_ERROR;
+	bool inside = pciemu_dma_inside_device_boundaries(txdesc->src,
+			txdesc->len);
+
+	if (!inside) {
+		qemu_log_mask(LOG_GUEST_ERROR, "src register out of bounds \n");
+	} else {
+		result = pciemu_compute(dma->config.cmd,
+				dma->buff + txdesc->src - PCIEMU_HW_DMA_AREA_START,
+				txdesc->len);
+	}
+
+	trace_pciemu_dma_compute(dma->config.cmd, txdesc->len, result);
+	pciemu_stats_dma(dev, dma->config.cmd, txdesc->len, !inside);
+	dma->result = result;
+	dma->error = !inside;
 }
 
 /**
@@ -58,9 +375,31 @@ static inline bool pciemu_dma_inside_device_boundaries(dma_addr_t addr)
 static void pciemu_dma_execute(PCIEMUDevice *dev)
 {
 	DMAEngine *dma = &dev->dma;
-	if (dma->config.cmd != PCIEMU_HW_DMA_DIRECTION_TO_DEVICE &&
-		dma->config.cmd != PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE)
+	trace_pciemu_dma_execute(dma->config.cmd, dma->config.txdesc.src,
+			dma->config.txdesc.dst, dma->config.txdesc.len);
+	pciemu_stats_lat_stamp(dev, PCIEMU_STATS_LAT_EXEC_START);
+	dma->result = PCIEMU_HW_DMA_RESULT_ERROR;
+	dma->error = true;
+	switch (dma->config.cmd) {
+	case PCIEMU_HW_DMA_DIRECTION_TO_DEVICE:
+	case PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE:
+		break;
+	case PCIEMU_HW_DMA_CMD_COPY:
+	case PCIEMU_HW_DMA_CMD_FILL:
+	case PCIEMU_HW_DMA_CMD_COMPARE:
+		pciemu_dma_offload(dev);
+		goto ended;
+	case PCIEMU_HW_DMA_CMD_CRC32C:
+	case PCIEMU_HW_DMA_CMD_CSUM:
+	case PCIEMU_HW_DMA_CMD_XOR:
+	case PCIEMU_HW_DMA_CMD_SUM:
+		pciemu_dma_compute(dev);
+		goto ended;
+	default:
+		qemu_log_mask(LOG_GUEST_ERROR, "unknown DMA command 0x%" PRIx64
+				"\n", dma->config.cmd);
 		return;
+	}
 	if (dma->config.cmd == PCIEMU_HW_DMA_DIRECTION_TO_DEVICE) {
 		/* DMA_DIRECTION_TO_DEVICE
 		 *   The transfer direction is RAM(or other device)->device.
@@ -70,17 +409,21 @@ static void pciemu_dma_execute(PCIEMUDevice *dev)
 		 *   dma->buff is the dedicated area inside the device to receive
 		 *   DMA transfers. Thus, dst is basically the offset of dma->buff.
 		 */
-		if (!pciemu_dma_inside_device_boundaries(dma->config.txdesc.dst)) {
+		if (!pciemu_dma_inside_device_boundaries(dma->config.txdesc.dst,
+					dma->config.txdesc.len)) {
 			qemu_log_mask(LOG_GUEST_ERROR, "dst register out of bounds \n");
 			return;
 		}
-		dma_addr_t src = pciemu_dma_addr_mask(dev, dma->config.txdesc.src);
+		dma_addr_t src = dma->config.txdesc.src;
 		dma_addr_t dst = dma->config.txdesc.dst - PCIEMU_HW_DMA_AREA_START;
-		int err = pci_dma_read(&dev->pci_dev, src, dma->buff + dst,
-				dma->config.txdesc.len);
-		if (err) {
-			qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_read err=%d\n", err);
-		}
+		int err = pciemu_dma_walk(dev, src, dma->config.txdesc.len,
+				DMA_DIRECTION_TO_DEVICE, pciemu_dma_chunk_read,
+				dma->buff + dst);
+		memory_region_set_dirty(dma->ram, dst, dma->config.txdesc.len);
+		pciemu_stats_dma(dev, dma->config.cmd, dma->config.txdesc.len, err);
+		dma->result = err ? PCIEMU_HW_DMA_RESULT_ERROR :
+			PCIEMU_HW_DMA_RESULT_OK;
+		dma->error = err;
 		pciemu_proxy_push_req(dev, PCIEMU_REQ_SYNC);
 	} else {
 		/* DMA_DIRECTION_FROM_DEVICE
@@ -91,19 +434,75 @@ static void pciemu_dma_execute(PCIEMUDevice *dev)
 		 *   dma->buff is the dedicated area inside the device to receive
 		 *   DMA transfers. Thus, src is basically the offset of dma->buff.
 		 */
-		if (!pciemu_dma_inside_device_boundaries(dma->config.txdesc.src)) {
+		if (!pciemu_dma_inside_device_boundaries(dma->config.txdesc.src,
+					dma->config.txdesc.len)) {
 			qemu_log_mask(LOG_GUEST_ERROR, "src register out of bounds \n");
 			return;
 		}
 		dma_addr_t src = dma->config.txdesc.src - PCIEMU_HW_DMA_AREA_START;
-		dma_addr_t dst = pciemu_dma_addr_mask(dev, dma->config.txdesc.dst);
-		int err = pci_dma_write(&dev->pci_dev, dst, dma->buff + src,
-					dma->config.txdesc.len);
-		if (err) {
-			qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_write err=%d\n", err);
-		}
+		dma_addr_t dst = dma->config.txdesc.dst;
+		int err = pciemu_dma_walk(dev, dst, dma->config.txdesc.len,
+				DMA_DIRECTION_FROM_DEVICE, pciemu_dma_chunk_write,
+				dma->buff + src);
+		pciemu_stats_dma(dev, dma->config.cmd, dma->config.txdesc.len, err);
+		dma->result = err ? PCIEMU_HW_DMA_RESULT_ERROR :
+			PCIEMU_HW_DMA_RESULT_OK;
+		dma->error = err;
 	}
+ended:
+	pciemu_stats_lat_stamp(dev, PCIEMU_STATS_LAT_EXEC_END);
 	pciemu_irq_raise(dev, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR);
+	pciemu_stats_lat_stamp(dev, PCIEMU_STATS_LAT_IRQ_RAISE);
+}
+
+/**
+ * pciemu_dma_clear_buff: Zero the device memory written since the last reset
+ *
+ * Device memory is dirty logged (DIRTY_MEMORY_VGA) for this purpose, so a
+ * reset only touches the pages that were written by the guest or by the
+ * device.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static void pciemu_dma_clear_buff(PCIEMUDevice *dev)
+{
+	DMAEngine *dma = &dev->dma;
+	MemoryRegion *mr = dma->ram;
+	hwaddr page = qemu_target_page_size();
+	DirtyBitmapSnapshot *snap;
+	hwaddr addr, len;
+	void *ptr;
+
+	snap = memory_region_snapshot_and_clear_dirty(mr, 0,
+			PCIEMU_HW_DMA_AREA_SIZE, DIRTY_MEMORY_VGA);
+
+	/* pages mapped from a snapshot file are replaced with anonymous
+	 * zero pages, which also drops the file mapping */
+	if (dma->buff_mapped) {
+		ptr = mmap(dma->buff, PCIEMU_HW_DMA_AREA_SIZE,
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+		if (ptr == dma->buff) {
+			dma->buff_mapped = false;
+			memory_region_set_dirty(mr, 0, PCIEMU_HW_DMA_AREA_SIZE);
+			goto out;
+		}
+	}
+
+	for (addr = 0; addr < PCIEMU_HW_DMA_AREA_SIZE; addr += page) {
+		len = MIN(page, PCIEMU_HW_DMA_AREA_SIZE - addr);
+		if (!memory_region_snapshot_get_dirty(mr, snap, addr, len))
+			continue;
+		memset(dma->buff + addr, 0, len);
+		memory_region_set_dirty(mr, addr, len);
+	}
+
+out:
+	/* the clearing itself is not a write to be undone at next reset,
+	 * only migration needs to see it */
+	memory_region_reset_dirty(mr, 0, PCIEMU_HW_DMA_AREA_SIZE,
+			DIRTY_MEMORY_VGA);
+	g_free(snap);
 }
 
 /* -----------------------------------------------------------------------------
@@ -166,6 +565,8 @@ void pciemu_dma_config_txdesc_len(PCIEMUDevice *dev, dma_size_t size)
  * The command register can take the following values (pciemu_hw.h);
  *   - PCIEMU_HW_DMA_DIRECTION_TO_DEVICE - DMA to device memory (dma->buff)
  *   - PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE - DMA from device memory (dma->buff)
+ *   - PCIEMU_HW_DMA_CMD_COPY/FILL/COMPARE - offload between bus addresses
+ *   - PCIEMU_HW_DMA_CMD_CRC32C/CSUM/XOR/SUM - compute on device memory
  *
  * @dev: Instance of PCIEMUDevice object being used
  */
@@ -216,6 +617,7 @@ void pciemu_dma_doorbell_ring(PCIEMUDevice *dev)
 					DMA_STATUS_EXECUTING);
 	if (status == DMA_STATUS_EXECUTING)
 		return;
+	pciemu_stats_lat_stamp(dev, PCIEMU_STATS_LAT_DOORBELL);
 	pciemu_dma_execute(dev);
 	qatomic_set(&dev->dma.status, DMA_STATUS_IDLE);
 }
@@ -237,9 +639,11 @@ void pciemu_dma_reset(PCIEMUDevice *dev)
 	dma->config.txdesc.dst = 0;
 	dma->config.txdesc.len = 0;
 	dma->config.cmd = 0;
+	dma->result = PCIEMU_HW_DMA_RESULT_OK;
+	dma->error = false;
 
 	/* clear the internal buffer */
-	memset(dma->buff, 0, PCIEMU_HW_DMA_AREA_SIZE);
+	pciemu_dma_clear_buff(dev);
 }
 
 /**
@@ -254,6 +658,58 @@ void pciemu_dma_reset(PCIEMUDevice *dev)
  */
 void pciemu_dma_init(PCIEMUDevice *dev, Error **errp)
 {
+	ERRP_GUARD();
+	DMAEngine *dma = &dev->dma;
+
+	/* Device memory is a RAM region: BAR 1 is mapped directly into the
+	 * guest (and from there into userspace) without trapping, and its
+	 * pages are tracked in the dirty bitmap, so migration copies them
+	 * iteratively with guest RAM. Writes done by the device itself must
+	 * be reported with memory_region_set_dirty().
+	 * With memdev, the memory comes from the backend (a file or memfd
+	 * shared with the proxy peer) and BAR 1 is an alias to it. Backends
+	 * with pages larger than the device memory (hugepages) are refused:
+	 * only the first PCIEMU_HW_DMA_AREA_SIZE bytes would ever be used.
+	 */
+	if (dma->hostmem) {
+		if (host_memory_backend_is_mapped(dma->hostmem)) {
+			error_setg(errp, "memdev '%s' is already in use",
+					object_get_canonical_path_component(
+						OBJECT(dma->hostmem)));
+			return;
+		}
+		dma->ram = host_memory_backend_get_memory(dma->hostmem);
+		if (memory_region_size(dma->ram) < PCIEMU_HW_DMA_AREA_SIZE) {
+			error_setg(errp, "memdev must be at least %d bytes",
+					PCIEMU_HW_DMA_AREA_SIZE);
+			return;
+		}
+		if (host_memory_backend_pagesize(dma->hostmem) >
+				PCIEMU_HW_DMA_AREA_SIZE) {
+			error_setg(errp, "memdev page size must not exceed %d bytes",
+					PCIEMU_HW_DMA_AREA_SIZE);
+			return;
+		}
+		host_memory_backend_set_mapped(dma->hostmem, true);
+		memory_region_init_alias(&dma->mem, OBJECT(dev), "pciemu-mem",
+				dma->ram, 0, PCIEMU_HW_DMA_AREA_SIZE);
+	} else {
+		memory_region_init_ram(&dma->mem, OBJECT(dev), "pciemu-mem",
+				PCIEMU_HW_DMA_AREA_SIZE, errp);
+		if (*errp)
+			return;
+		dma->ram = &dma->mem;
+	}
+	dma->buff = memory_region_get_ram_ptr(dma->ram);
+	dma->buff_mapped = false;
+	/* log writes to clear only those on reset (pciemu_dma_clear_buff) */
+	memory_region_set_log(dma->ram, true, DIRTY_MEMORY_VGA);
+	pci_register_bar(&dev->pci_dev, PCIEMU_HW_BAR1,
+			PCI_BASE_ADDRESS_SPACE_MEMORY |
+			PCI_BASE_ADDRESS_MEM_TYPE_64 |
+			PCI_BASE_ADDRESS_MEM_PREFETCH,
+			&dma->mem);
+
 	/* Basically reset the DMA engine */
 	pciemu_dma_reset(dev);
 
@@ -275,17 +731,76 @@ void pciemu_dma_fini(PCIEMUDevice *dev)
 {
 	pciemu_dma_reset(dev);
 	dev->dma.status = DMA_STATUS_OFF;
+	memory_region_set_log(dev->dma.ram, false, DIRTY_MEMORY_VGA);
+	if (dev->dma.hostmem)
+		host_memory_backend_set_mapped(dev->dma.hostmem, false);
+	/* without memdev, the RAM block goes away with dma.mem */
+	dev->dma.buff = NULL;
+	dev->dma.ram = NULL;
 }
 
+/**
+ * pciemu_dma_pre_save: Check the DMA engine is quiescent before saving
+ *
+ * Commands run to completion once picked up, and a doorbell still pending
+ * in its ioeventfd is run before the device state is saved (see
+ * pciemu_mmio_doorbell_flush), so no command can be in flight here.
+ *
+ * @opaque: DMAEngine being saved
+ */
+static int pciemu_dma_pre_save(void *opaque)
+{
+	DMAEngine *dma = opaque;
+
+	if (qatomic_read(&dma->status) != DMA_STATUS_IDLE)
+		return -EBUSY;
+	return 0;
+}
+
+/**
+ * pciemu_dma_post_load: Restore the DMA engine state not in the stream
+ *
+ * @opaque: DMAEngine being loaded
+ * @version_id: version of the incoming section (unused)
+ */
+static int pciemu_dma_post_load(void *opaque, int version_id)
+{
+	DMAEngine *dma = opaque;
+
+	dma->status = DMA_STATUS_IDLE;
+	dma->config.mask = DMA_BIT_MASK(PCIEMU_HW_DMA_ADDR_CAPABILITY);
+	return 0;
+}
+
+const VMStateDescription vmstate_pciemu_dma = {
+	.name = "pciemu-dma",
+	.version_id = 1,
+	.minimum_version_id = 1,
+	.pre_save = pciemu_dma_pre_save,
+	.post_load = pciemu_dma_post_load,
+	.fields = (const VMStateField[]) {
+		VMSTATE_UINT64(config.txdesc.src, DMAEngine),
+		VMSTATE_UINT64(config.txdesc.dst, DMAEngine),
+		VMSTATE_UINT64(config.txdesc.len, DMAEngine),
+		VMSTATE_UINT64(config.cmd, DMAEngine),
+		VMSTATE_UINT64(result, DMAEngine),
+		VMSTATE_BOOL(error, DMAEngine),
+		/* buff is migrated as RAM (dma.mem or the memdev) */
+		VMSTATE_END_OF_LIST()
+	}
+};
+
 /**
  * pciemu_dma_input: Read input data into DMA buffer
  */
 int pciemu_dma_input(PCIEMUDevice *dev)
 {
-	int ret, len;
+	int ret;
 	DMAEngine *dma;
 	DMAStatus status;
-	dma_addr_t src, dst;
+	dma_addr_t src;
+	dma_size_t len;
+	uint8_t *dst;
 
 	status = qatomic_cmpxchg(&dev->dma.status, DMA_STATUS_IDLE,
 			DMA_STATUS_EXECUTING);
@@ -293,14 +808,16 @@ int pciemu_dma_input(PCIEMUDevice *dev)
 		return EXIT_FAILURE;
 
 	dma = &dev->dma;
-	src = pciemu_dma_addr_mask(dev, dma->config.txdesc.src);
+	src = dma->config.txdesc.src;
 	dst = dma->buff;
-	len = dma->config.txdesc.len;
-	ret = pci_dma_read(&dev->pci_dev, src, dst, len);
-	if (ret) {
-		qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_read err=%d\n", err);
+	len = MIN(dma->config.txdesc.len, PCIEMU_HW_DMA_AREA_SIZE);
+	ret = pciemu_dma_walk(dev, src, len, DMA_DIRECTION_TO_DEVICE,
+			pciemu_dma_chunk_read, dst);
+	memory_region_set_dirty(dma->ram, 0, len);
+	if (ret)
 		ret = EXIT_FAILURE;
-	}
+	trace_pciemu_dma_input(src, len, ret);
+	pciemu_stats_dma(dev, PCIEMU_HW_DMA_DIRECTION_TO_DEVICE, len, ret);
 
 	qatomic_set(&dev->dma.status, DMA_STATUS_IDLE);
 	return ret;
@@ -311,10 +828,12 @@ int pciemu_dma_input(PCIEMUDevice *dev)
  */
 int pciemu_dma_output(PCIEMUDevice *dev)
 {
-	int ret, len;
+	int ret;
 	DMAEngine *dma;
 	DMAStatus status;
-	dma_addr_t src, dst;
+	dma_addr_t dst;
+	dma_size_t len;
+	uint8_t *src;
 
 	status = qatomic_cmpxchg(&dev->dma.status, DMA_STATUS_IDLE,
 			DMA_STATUS_EXECUTING);
@@ -323,13 +842,14 @@ int pciemu_dma_output(PCIEMUDevice *dev)
 
 	dma = &dev->dma;
 	src = dma->buff;
-	dst = pciemu_dma_addr_mask(dev, dma->config.txdesc.dst);
-	len = dma->config.txdesc.len;
-	ret = pci_dma_write(&dev->pci_dev, dst, src, len);
-	if (ret) {
-		qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_write err=%d\n", err);
+	dst = dma->config.txdesc.dst;
+	len = MIN(dma->config.txdesc.len, PCIEMU_HW_DMA_AREA_SIZE);
+	ret = pciemu_dma_walk(dev, dst, len, DMA_DIRECTION_FROM_DEVICE,
+			pciemu_dma_chunk_write, src);
+	if (ret)
 		ret = EXIT_FAILURE;
-	}
+	trace_pciemu_dma_output(dst, len, ret);
+	pciemu_stats_dma(dev, PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE, len, ret);
 
 	qatomic_set(&dev->dma.status, DMA_STATUS_IDLE);
 	return ret;
@@ -11,6 +11,7 @@
 
 #include "qemu/osdep.h"
 #include "hw/pci/pci.h"
+#include "sysemu/hostmem.h"
 #include "pciemu_hw.h"
 
 #define DMA_BIT_MASK(n) (((n) == 64) ? ~0ULL : ((1ULL << (n)) - 1))
@@ -51,7 +52,16 @@ typedef enum DMAStatus {
 typedef struct DMAEngine {
 	DMAConfig config;
 	DMAStatus status;
-	uint8_t buff[PCIEMU_HW_DMA_AREA_SIZE];
+	uint64_t result; /* outcome of the last command (DMA_RESULT) */
+	bool error; /* the last command failed (DMA_STATUS) */
+	/* device memory, also exposed to the host as BAR 1 (mem) */
+	uint8_t *buff;
+	bool buff_mapped; /* buff mapped from a snapshot file (MAP_PRIVATE) */
+	MemoryRegion mem;
+	/* RAM behind mem: mem itself, or the memory of hostmem (memdev) when
+	 * mem is an alias to it */
+	MemoryRegion *ram;
+	HostMemoryBackend *hostmem;
 } DMAEngine;
 
 
@@ -78,4 +88,6 @@ int pciemu_dma_input(PCIEMUDevice *dev);
 
 int pciemu_dma_output(PCIEMUDevice *dev);
 
+extern const VMStateDescription vmstate_pciemu_dma;
+
 #endif /* PCIEMU_DMA_H */
@@ -0,0 +1,12 @@
+    {
+        .name       = "pciemu",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show pciemu device performance counters",
+        .cmd        = hmp_info_pciemu,
+    },
+
+SRST
+  ``info pciemu``
+    Show the performance counters of every pciemu device.
+ERST
@@ -8,9 +8,12 @@
 
 #include "qemu/osdep.h"
 #include "qemu/log.h"
+#include "qapi/error.h"
 #include "hw/pci/msi.h"
+#include "migration/vmstate.h"
 #include "pciemu.h"
 #include "irq.h"
+#include "trace.h"
 
 /* -----------------------------------------------------------------------------
  *  Private
@@ -21,16 +24,24 @@
  * pciemu_irq_init_msi: IRQ initialization in MSI mode
  *
  * Initialize the prefered MSI mode if the host is able to handle MSI.
+ * A board without working MSI (-ENOTSUP) is not an error: the device
+ * falls back to PIN-IRQ.
  *
  * @dev: Instance of PCIEMUDevice object being initialized
  * @errp: pointer to indicate errors
  */
 static inline void pciemu_irq_init_msi(PCIEMUDevice *dev, Error **errp)
 {
-	if (msi_init(&dev->pci_dev, 0, PCIEMU_HW_IRQ_CNT, true, false, errp)) {
+	Error *err = NULL;
+	int ret;
+
+	ret = msi_init(&dev->pci_dev, 0, PCIEMU_HW_IRQ_CNT, true, false, &err);
+	if (ret == -ENOTSUP) {
 		qemu_log_mask(LOG_GUEST_ERROR, "MSI Init Error\n");
+		error_free(err);
 		return;
 	}
+	error_propagate(errp, err);
 }
 
 /**
@@ -126,6 +137,8 @@ static inline void pciemu_irq_lower_msi(PCIEMUDevice *dev, unsigned int vector)
  */
 void pciemu_irq_raise(PCIEMUDevice *dev, unsigned int vector)
 {
+	trace_pciemu_irq_raise(vector, msi_enabled(&dev->pci_dev));
+	stat64_add(&dev->stats.irqs_raised, 1);
 	/* If no MSI available on host, we should fallback to pin IRQ assertion */
 	if (!msi_enabled(&dev->pci_dev)) {
 		pciemu_irq_raise_intx(dev);
@@ -145,6 +158,7 @@ void pciemu_irq_raise(PCIEMUDevice *dev, unsigned int vector)
  */
 void pciemu_irq_lower(PCIEMUDevice *dev, unsigned int vector)
 {
+	trace_pciemu_irq_lower(vector, msi_enabled(&dev->pci_dev));
 	/* If no MSI available on host, we should fallback to pin IRQ assertion */
 	if (!msi_enabled(&dev->pci_dev)) {
 		pciemu_irq_lower_intx(dev);
@@ -199,3 +213,30 @@ void pciemu_irq_fini(PCIEMUDevice *dev)
 	pciemu_irq_reset(dev);
 	msi_uninit(&dev->pci_dev);
 }
+
+static const VMStateDescription vmstate_pciemu_msi_vector = {
+	.name = "pciemu-msi-vector",
+	.version_id = 1,
+	.minimum_version_id = 1,
+	.fields = (const VMStateField[]) {
+		VMSTATE_BOOL(raised, MSIVector),
+		VMSTATE_END_OF_LIST()
+	}
+};
+
+/* Both views of the status union are saved, only the one matching the
+ * guest's MSI setting is meaningful. The INTx level and the MSI capability
+ * are migrated by the PCI core as part of the config space.
+ */
+const VMStateDescription vmstate_pciemu_irq = {
+	.name = "pciemu-irq",
+	.version_id = 1,
+	.minimum_version_id = 1,
+	.fields = (const VMStateField[]) {
+		VMSTATE_STRUCT_ARRAY(status.msi.msi_vectors, IRQStatus,
+				PCIEMU_IRQ_MAX_VECTORS, 0,
+				vmstate_pciemu_msi_vector, MSIVector),
+		VMSTATE_BOOL(status.pin.raised, IRQStatus),
+		VMSTATE_END_OF_LIST()
+	}
+};
@@ -54,4 +54,6 @@ void pciemu_irq_init(PCIEMUDevice *dev, Error **errp);
 
 void pciemu_irq_fini(PCIEMUDevice *dev);
 
+extern const VMStateDescription vmstate_pciemu_irq;
+
 #endif /* PCIEMU_IRQ_H */
@@ -9,13 +9,18 @@
  *
  */
 #include "qemu/osdep.h"
-#include "exec/target_page.h"
 #include "qapi/error.h"
+#include "qemu/bitops.h"
 #include "qemu/log.h"
+#include "qemu/memalign.h"
 #include "qemu/units.h"
+#include "migration/vmstate.h"
 #include "mmio.h"
 #include "irq.h"
+#include "pciemu.h"
 #include "pciemu_hw.h"
+#include "stats.h"
+#include "trace.h"
 
 /* -----------------------------------------------------------------------------
  *  Private
@@ -23,49 +28,232 @@
  */
 
 /**
- * pciemu_mmio_valid_access: Check whether the access is valid
+ * pciemu_mmio_read_reg: Read one of the general purpose registers (reg)
+ *
+ * The regs page is RAM backed: guest accesses do not trap, these handlers
+ * are only used by the device itself (e.g. on reset). The guest may update
+ * the registers at any time, the device observes them lazily, when it
+ * needs them (e.g. on a doorbell).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @addr: address being accessed (relative to the Memory Region)
+ */
+static uint64_t pciemu_mmio_read_reg(PCIEMUDevice *dev, hwaddr addr)
+{
+	return dev->reg[(addr - PCIEMU_HW_BAR0_REG_0) / PCIEMU_HW_REG_WIDTH];
+}
+
+/**
+ * pciemu_mmio_write_reg: Write one of the general purpose registers (reg)
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @addr: address being written (relative to the Memory Region)
+ * @val: value to be written
+ */
+static void pciemu_mmio_write_reg(PCIEMUDevice *dev, hwaddr addr,
+		uint64_t val)
+{
+	dev->reg[(addr - PCIEMU_HW_BAR0_REG_0) / PCIEMU_HW_REG_WIDTH] = val;
+}
+
+/**
+ * pciemu_mmio_write_irq_raise: Raise IRQ 0
+ *
+ * Left here for debug purposes only.
+ * Attempting to raise the IRQ0 when using the default device
+ * driver may cause a crash during the unpinning process.
+ */
+static void pciemu_mmio_write_irq_raise(PCIEMUDevice *dev, hwaddr addr,
+		uint64_t val)
+{
+	pciemu_irq_raise(dev, 0);
+}
+
+/**
+ * pciemu_mmio_write_irq_lower: Lower IRQ 0 (ACK from the driver)
+ */
+static void pciemu_mmio_write_irq_lower(PCIEMUDevice *dev, hwaddr addr,
+		uint64_t val)
+{
+	pciemu_irq_lower(dev, 0);
+	pciemu_stats_lat_stamp(dev, PCIEMU_STATS_LAT_IRQ_LOWER);
+}
+
+static uint64_t pciemu_mmio_read_dma_src(PCIEMUDevice *dev, hwaddr addr)
+{
+	return dev->dma.config.txdesc.src;
+}
+
+static void pciemu_mmio_write_dma_src(PCIEMUDevice *dev, hwaddr addr,
+		uint64_t val)
+{
+	pciemu_dma_config_txdesc_src(dev, val);
+}
+
+static uint64_t pciemu_mmio_read_dma_dst(PCIEMUDevice *dev, hwaddr addr)
+{
+	return dev->dma.config.txdesc.dst;
+}
+
+static void pciemu_mmio_write_dma_dst(PCIEMUDevice *dev, hwaddr addr,
+		uint64_t val)
+{
+	pciemu_dma_config_txdesc_dst(dev, val);
+}
+
+static uint64_t pciemu_mmio_read_dma_len(PCIEMUDevice *dev, hwaddr addr)
+{
+	return dev->dma.config.txdesc.len;
+}
+
+static void pciemu_mmio_write_dma_len(PCIEMUDevice *dev, hwaddr addr,
+		uint64_t val)
+{
+	pciemu_dma_config_txdesc_len(dev, val);
+}
+
+static uint64_t pciemu_mmio_read_dma_cmd(PCIEMUDevice *dev, hwaddr addr)
+{
+	return dev->dma.config.cmd;
+}
+
+static void pciemu_mmio_write_dma_cmd(PCIEMUDevice *dev, hwaddr addr,
+		uint64_t val)
+{
+	pciemu_dma_config_cmd(dev, val);
+}
+
+static uint64_t pciemu_mmio_read_dma_result(PCIEMUDevice *dev, hwaddr addr)
+{
+	return dev->dma.result;
+}
+
+static uint64_t pciemu_mmio_read_dma_status(PCIEMUDevice *dev, hwaddr addr)
+{
+	return dev->dma.error ? PCIEMU_HW_DMA_STATUS_ERROR : 0;
+}
+
+/**
+ * pciemu_mmio_write_doorbell: Ring the DMA doorbell
+ */
+static void pciemu_mmio_write_doorbell(PCIEMUDevice *dev, hwaddr addr,
+		uint64_t val)
+{
+	stat64_add(&dev->stats.doorbells, 1);
+	pciemu_dma_doorbell_ring(dev);
+}
+
+/* Handlers of each register of PCIEMU_HW_BAR0_REGS (NULL if not accessible) */
+#define pciemu_mmio_read_REG_0 pciemu_mmio_read_reg
+#define pciemu_mmio_write_REG_0 pciemu_mmio_write_reg
+#define pciemu_mmio_read_REG_1 pciemu_mmio_read_reg
+#define pciemu_mmio_write_REG_1 pciemu_mmio_write_reg
+#define pciemu_mmio_read_REG_2 pciemu_mmio_read_reg
+#define pciemu_mmio_write_REG_2 pciemu_mmio_write_reg
+#define pciemu_mmio_read_REG_3 pciemu_mmio_read_reg
+#define pciemu_mmio_write_REG_3 pciemu_mmio_write_reg
+#define pciemu_mmio_read_IRQ_0_RAISE NULL
+#define pciemu_mmio_write_IRQ_0_RAISE pciemu_mmio_write_irq_raise
+#define pciemu_mmio_read_IRQ_0_LOWER NULL
+#define pciemu_mmio_write_IRQ_0_LOWER pciemu_mmio_write_irq_lower
+#define pciemu_mmio_read_DMA_CFG_TXDESC_SRC pciemu_mmio_read_dma_src
+#define pciemu_mmio_write_DMA_CFG_TXDESC_SRC pciemu_mmio_write_dma_src
+#define pciemu_mmio_read_DMA_CFG_TXDESC_DST pciemu_mmio_read_dma_dst
+#define pciemu_mmio_write_DMA_CFG_TXDESC_DST pciemu_mmio_write_dma_dst
+#define pciemu_mmio_read_DMA_CFG_TXDESC_LEN pciemu_mmio_read_dma_len
+#define pciemu_mmio_write_DMA_CFG_TXDESC_LEN pciemu_mmio_write_dma_len
+#define pciemu_mmio_read_DMA_CFG_CMD pciemu_mmio_read_dma_cmd
+#define pciemu_mmio_write_DMA_CFG_CMD pciemu_mmio_write_dma_cmd
+#define pciemu_mmio_read_DMA_RESULT pciemu_mmio_read_dma_result
+#define pciemu_mmio_write_DMA_RESULT NULL
+#define pciemu_mmio_read_DMA_STATUS pciemu_mmio_read_dma_status
+#define pciemu_mmio_write_DMA_STATUS NULL
+#define pciemu_mmio_read_DMA_DOORBELL_RING NULL
+#define pciemu_mmio_write_DMA_DOORBELL_RING pciemu_mmio_write_doorbell
+
+#define PCIEMU_MMIO_REG(_name, _offset, _width, _access, _reset) \
+	[PCIEMU_HW_REG_SLOT(_offset)] = { \
+		.name = #_name, \
+		.offset = (_offset), \
+		.width = (_width), \
+		.access = (_access), \
+		.reset = (_reset), \
+		.read = pciemu_mmio_read_##_name, \
+		.write = pciemu_mmio_write_##_name, \
+	},
+
+/* BAR0 register table, indexed by register slot (PCIEMU_HW_REG_SLOT) */
+static const PCIEMUMmioReg pciemu_mmio_regs[PCIEMU_HW_BAR0_REG_SLOTS] = {
+	PCIEMU_HW_BAR0_REGS(PCIEMU_MMIO_REG)
+};
+
+/**
+ * pciemu_mmio_reg_lookup: Find the register being accessed
  *
  * The size verification here is not required.
  * (memory_region_access_valid function in QEMU core will filter those out)
  *
+ * Registers may be accessed as a whole or as 32-bit halves (low half at the
+ * register offset, high half at offset + 4), so that 32-bit hosts can
+ * program 64-bit values with two writes.
+ *
  * @addr: address being accessed (relative to the Memory Region)
- * @size: read size in bytes (1, 2, 4, or 8)
+ * @size: access size in bytes (4 or 8)
+ * @access: PCIEMU_HW_REG_RD or PCIEMU_HW_REG_WR
+ *
+ * Returns the register, or NULL if addr/size do not match a register (or
+ * one of its halves) allowing that access.
  */
-static inline bool pciemu_mmio_valid_access(hwaddr addr, unsigned int size)
+static inline const PCIEMUMmioReg *pciemu_mmio_reg_lookup(hwaddr addr,
+		unsigned int size, unsigned int access)
 {
-	return (PCIEMU_HW_BAR0_START <= addr && addr <= PCIEMU_HW_BAR0_END);
+	const PCIEMUMmioReg *reg;
+
+	if (addr >= PCIEMU_HW_BAR0_SIZE ||
+		addr % PCIEMU_HW_BAR0_PAGE_SIZE >=
+		PCIEMU_HW_BAR0_PAGE_SLOTS * PCIEMU_HW_REG_WIDTH)
+		return NULL;
+
+	reg = &pciemu_mmio_regs[PCIEMU_HW_REG_SLOT(addr)];
+	if (!reg->name || !(reg->access & access))
+		return NULL;
+	if (addr - reg->offset + size > reg->width ||
+		(addr - reg->offset) % size)
+		return NULL;
+
+	return reg;
 }
 
 /**
  * pciemu_mmio_read: Callback for read operations
  *
  * Read from the memory region and return the correspondent value.
- * Only valid for regions with READ operations (mostly regiters)
+ * Only valid for registers with READ access (see PCIEMU_HW_BAR0_REGS).
  *
- * @opaque: opaque pointer that points to instantiated object
- * @addr: address being accessed (relative to the Memory Region)
+ * @opaque: opaque pointer that points to the accessed block
+ * @addr: address being accessed (relative to the block)
  * @size: read size in bytes (1, 2, 4, or 8)
  */
 static uint64_t pciemu_mmio_read(void *opaque, hwaddr addr, unsigned int size)
 {
-	PCIEMUDevice *dev = opaque;
+	PCIEMUMmioBlock *block = opaque;
+	PCIEMUDevice *dev = block->dev;
+	const PCIEMUMmioReg *reg;
 	uint64_t val = ~0ULL;
-	if (!pciemu_mmio_valid_access(addr, size))
+
+	addr += block->base;
+	reg = pciemu_mmio_reg_lookup(addr, size, PCIEMU_HW_REG_RD);
+	if (!reg) {
+		qemu_log_mask(LOG_GUEST_ERROR, "pciemu: bad read at 0x%"
+				HWADDR_PRIx "\n", addr);
 		return val;
-	switch (addr) {
-	case PCIEMU_HW_BAR0_REG_0:
-		val = dev->reg[0];
-		break;
-	case PCIEMU_HW_BAR0_REG_1:
-		val = dev->reg[1];
-		break;
-	case PCIEMU_HW_BAR0_REG_2:
-		val = dev->reg[2];
-		break;
-	case PCIEMU_HW_BAR0_REG_3:
-		val = dev->reg[3];
-		break;
 	}
+
+	pciemu_stats_mmio_read(dev, reg->offset);
+	val = extract64(reg->read(dev, reg->offset),
+			(addr - reg->offset) * BITS_PER_BYTE,
+			size * BITS_PER_BYTE);
+	trace_pciemu_mmio_read(addr, size, val);
 	return val;
 }
 
@@ -73,61 +261,60 @@ static uint64_t pciemu_mmio_read(void *opaque, hwaddr addr, unsigned int size)
  * pciemu_mmio_write: Callback for write operations
  *
  * Write to the memory region.
- * For now, it writes to reg0 regardless of the address.
+ * Only valid for registers with WRITE access (see PCIEMU_HW_BAR0_REGS).
  *
- * @opaque: opaque pointer that points to instantiated object
- * @addr: address being written (relative to the Memory Region)
+ * @opaque: opaque pointer that points to the accessed block
+ * @addr: address being written (relative to the block)
  * @val: value to be written
  * @size: write size in bytes (1, 2, 4, or 8)
  */
 static void pciemu_mmio_write(void *opaque, hwaddr addr, uint64_t val,
 			unsigned size)
 {
-	PCIEMUDevice *dev = opaque;
-	if (!pciemu_mmio_valid_access(addr, size))
+	PCIEMUMmioBlock *block = opaque;
+	PCIEMUDevice *dev = block->dev;
+	const PCIEMUMmioReg *reg;
+	uint64_t old = 0;
+
+	addr += block->base;
+	trace_pciemu_mmio_write(addr, size, val);
+	reg = pciemu_mmio_reg_lookup(addr, size, PCIEMU_HW_REG_WR);
+	if (!reg) {
+		qemu_log_mask(LOG_GUEST_ERROR, "pciemu: bad write at 0x%"
+				HWADDR_PRIx "\n", addr);
 		return;
-	switch (addr) {
-	case PCIEMU_HW_BAR0_REG_0:
-		dev->reg[0] = val;
-		break;
-	case PCIEMU_HW_BAR0_REG_1:
-		dev->reg[1] = val;
-		break;
-	case PCIEMU_HW_BAR0_REG_2:
-		dev->reg[2] = val;
-		break;
-	case PCIEMU_HW_BAR0_REG_3:
-		dev->reg[3] = val;
-		break;
-		/* Left here for debug purposes only
-		 * Attempting to raise the IRQ0 when using the default device
-		 * driver may cause a crash during the unpinning process.
-		 */
-	case PCIEMU_HW_BAR0_IRQ_0_RAISE:
-		pciemu_irq_raise(dev, 0);
-		break;
-	case PCIEMU_HW_BAR0_IRQ_0_LOWER:
-		pciemu_irq_lower(dev, 0);
-		break;
-	case PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC:
-		pciemu_dma_config_txdesc_src(dev, val);
-		break;
-	case PCIEMU_HW_BAR0_DMA_CFG_TXDESC_DST:
-		pciemu_dma_config_txdesc_dst(dev, val);
-		break;
-	case PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN:
-		pciemu_dma_config_txdesc_len(dev, val);
-		break;
-	case PCIEMU_HW_BAR0_DMA_CFG_CMD:
-		pciemu_dma_config_cmd(dev, val);
-		break;
-	case PCIEMU_HW_BAR0_DMA_DOORBELL_RING:
-		if (!pciemu_dma_input(dev))
-			break;
-		pciemu_proxy_push_req(PCIEMU_REQ_SYNC);
-		pciemu_proxy_push_req(PCIEMU_REQ_RING);
-		break;
 	}
+
+	/* partial write of a readable register: merge with the other half */
+	if (size < reg->width && reg->read)
+		old = reg->read(dev, reg->offset);
+	if (size < reg->width)
+		val = deposit64(old, (addr - reg->offset) * BITS_PER_BYTE,
+				size * BITS_PER_BYTE, val);
+
+	pciemu_stats_mmio_write(dev, reg->offset);
+	reg->write(dev, reg->offset, val);
+}
+
+/**
+ * pciemu_mmio_doorbell_notify: Doorbell rung through the ioeventfd
+ *
+ * Guest writes of PCIEMU_HW_BAR0_DMA_DOORBELL_RING matching the ioeventfd
+ * do not exit to pciemu_mmio_write, they only signal the notifier, which
+ * is handled here from the main loop.
+ *
+ * @e: doorbell notifier
+ */
+static void pciemu_mmio_doorbell_notify(EventNotifier *e)
+{
+	PCIEMUMmio *mmio = container_of(e, PCIEMUMmio, doorbell);
+
+	if (!event_notifier_test_and_clear(e))
+		return;
+
+	pciemu_mmio_write(&mmio->block[PCIEMU_HW_BAR0_PAGE_DOORBELL],
+			PCIEMU_HW_BAR0_DMA_DOORBELL_RING -
+			PCIEMU_HW_BAR0_PAGE(PCIEMU_HW_BAR0_PAGE_DOORBELL), 1, 4);
 }
 
 /* -----------------------------------------------------------------------------
@@ -138,15 +325,36 @@ static void pciemu_mmio_write(void *opaque, hwaddr addr, uint64_t val,
 /**
  * pciemu_mmio_reset: MMIO reset
  *
- * As the mmio block controls the device registers (reg),
- * we just clean them up here.
+ * Every RW register holds state: write back its reset value.
+ * WO registers trigger actions (IRQ, doorbell) and are left alone.
  *
  * @dev: Instance of PCIEMUDevice object being used
  */
 void pciemu_mmio_reset(PCIEMUDevice *dev)
 {
-	for (int i = 0; i < PCIEMU_HW_BAR0_REG_CNT; ++i)
-		dev->reg[i] = 0;
+	const PCIEMUMmioReg *reg;
+
+	for (int i = 0; i < PCIEMU_HW_BAR0_REG_SLOTS; ++i) {
+		reg = &pciemu_mmio_regs[i];
+		if (reg->name && (reg->access & PCIEMU_HW_REG_RW) ==
+				PCIEMU_HW_REG_RW)
+			reg->write(dev, reg->offset, reg->reset);
+	}
+}
+
+/**
+ * pciemu_mmio_doorbell_flush: Run a doorbell still pending in the ioeventfd
+ *
+ * A doorbell rung by a vCPU just before it stopped may not have been
+ * picked up by the main loop yet. Called once the vCPUs are stopped, so
+ * that the command runs before the device state is saved.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_mmio_doorbell_flush(PCIEMUDevice *dev)
+{
+	if (dev->mmio.doorbell_ioeventfd)
+		pciemu_mmio_doorbell_notify(&dev->mmio.doorbell);
 }
 
 /**
@@ -156,17 +364,70 @@ void pciemu_mmio_reset(PCIEMUDevice *dev)
  * Note that we receive a pointer for a PCIEMUDevice, but, due to the OOP hack
  * done by the QEMU Object Model, we can easily get the parent PCIDevice.
  *
+ * BAR 0 is a container with one subregion (pciemu_mmio_ops) per function
+ * block, each on its own page. The doorbell page gets an ioeventfd so that
+ * ringing it does not need a synchronous exit to the device model.
+ * The regs page only holds plain storage, it is backed by host memory that
+ * the guest accesses directly (no VM exit on polling loops).
+ *
  * @dev: Instance of PCIEMUDevice object being initialized
  * @errp: pointer to indicate errors
  */
 void pciemu_mmio_init(PCIEMUDevice *dev, Error **errp)
 {
-	/* BAR 0 will have memory region described in mmio (pciemu_mmio_ops) */
-	/* Keeping the BAR size as the page size of the guest */
-	memory_region_init_io(&dev->mmio, OBJECT(dev), &pciemu_mmio_ops, dev,
-			"pciemu-mmio", qemu_target_page_size());
-	pci_register_bar(&dev->pci_dev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY,
-			&dev->mmio);
+	static const char *const names[PCIEMU_HW_BAR0_PAGE_CNT] = {
+		[PCIEMU_HW_BAR0_PAGE_REGS] = "pciemu-mmio-regs",
+		[PCIEMU_HW_BAR0_PAGE_IRQ] = "pciemu-mmio-irq",
+		[PCIEMU_HW_BAR0_PAGE_DMA_CFG] = "pciemu-mmio-dma-cfg",
+		[PCIEMU_HW_BAR0_PAGE_DOORBELL] = "pciemu-mmio-doorbell",
+	};
+	PCIEMUMmio *mmio = &dev->mmio;
+	PCIEMUMmioBlock *block;
+	int ret;
+
+	memory_region_init(&mmio->bar, OBJECT(dev), "pciemu-mmio",
+			PCIEMU_HW_BAR0_SIZE);
+	for (int i = 0; i < PCIEMU_HW_BAR0_PAGE_CNT; ++i) {
+		block = &mmio->block[i];
+		block->dev = dev;
+		block->base = PCIEMU_HW_BAR0_PAGE(i);
+		if (i == PCIEMU_HW_BAR0_PAGE_REGS)
+			continue;
+		memory_region_init_io(&block->mr, OBJECT(dev), &pciemu_mmio_ops,
+				block, names[i], PCIEMU_HW_BAR0_PAGE_SIZE);
+		memory_region_add_subregion(&mmio->bar, block->base, &block->mr);
+	}
+
+	/* RAM backed regs page (host page aligned to be mapped directly) */
+	block = &mmio->block[PCIEMU_HW_BAR0_PAGE_REGS];
+	mmio->regs_page = qemu_memalign(qemu_real_host_page_size(),
+			MAX(qemu_real_host_page_size(), PCIEMU_HW_BAR0_PAGE_SIZE));
+	memset(mmio->regs_page, 0, PCIEMU_HW_BAR0_PAGE_SIZE);
+	dev->reg = (uint64_t *)((uint8_t *)mmio->regs_page +
+			PCIEMU_HW_BAR0_REG_0 - block->base);
+	memory_region_init_ram_device_ptr(&block->mr, OBJECT(dev),
+			names[PCIEMU_HW_BAR0_PAGE_REGS], PCIEMU_HW_BAR0_PAGE_SIZE,
+			mmio->regs_page);
+	memory_region_add_subregion(&mmio->bar, block->base, &block->mr);
+
+	/* Doorbell ioeventfd (the driver rings it with 32-bit writes) */
+	ret = event_notifier_init(&mmio->doorbell, 0);
+	mmio->doorbell_ioeventfd = !ret;
+	if (ret < 0) {
+		qemu_log_mask(LOG_UNIMP, "pciemu: no doorbell ioeventfd (%d)\n",
+				ret);
+	} else {
+		event_notifier_set_handler(&mmio->doorbell,
+				pciemu_mmio_doorbell_notify);
+		memory_region_add_eventfd(
+				&mmio->block[PCIEMU_HW_BAR0_PAGE_DOORBELL].mr,
+				PCIEMU_HW_BAR0_DMA_DOORBELL_RING -
+				PCIEMU_HW_BAR0_PAGE(PCIEMU_HW_BAR0_PAGE_DOORBELL),
+				4, false, 0, &mmio->doorbell);
+	}
+
+	pci_register_bar(&dev->pci_dev, PCIEMU_HW_BAR0,
+			PCI_BASE_ADDRESS_SPACE_MEMORY, &mmio->bar);
 }
 
 /**
@@ -180,7 +441,36 @@ void pciemu_mmio_init(PCIEMUDevice *dev, Error **errp)
  */
 void pciemu_mmio_fini(PCIEMUDevice *dev)
 {
+	PCIEMUMmio *mmio = &dev->mmio;
+
+	if (mmio->doorbell_ioeventfd) {
+		memory_region_del_eventfd(
+				&mmio->block[PCIEMU_HW_BAR0_PAGE_DOORBELL].mr,
+				PCIEMU_HW_BAR0_DMA_DOORBELL_RING -
+				PCIEMU_HW_BAR0_PAGE(PCIEMU_HW_BAR0_PAGE_DOORBELL),
+				4, false, 0, &mmio->doorbell);
+		event_notifier_set_handler(&mmio->doorbell, NULL);
+		event_notifier_cleanup(&mmio->doorbell);
+		mmio->doorbell_ioeventfd = false;
+	}
 	pciemu_mmio_reset(dev);
+	dev->reg = NULL;
+	/* regs_page is freed with the device (pciemu_mmio_finalize) */
+}
+
+/**
+ * pciemu_mmio_finalize: Free the memory behind the regs block
+ *
+ * The regs block may still be referenced by flat views (freed under RCU)
+ * after unrealize. Those views hold a reference to the device, so the
+ * memory is only freed when the device object itself goes away.
+ *
+ * @dev: Instance of PCIEMUDevice object being finalized
+ */
+void pciemu_mmio_finalize(PCIEMUDevice *dev)
+{
+	qemu_vfree(dev->mmio.regs_page);
+	dev->mmio.regs_page = NULL;
 }
 
 /**
@@ -203,3 +493,15 @@ const MemoryRegionOps pciemu_mmio_ops = {
 		.max_access_size = 8,
 	},
 };
+
+/* The regs page is a RAM device region, which RAM migration skips */
+const VMStateDescription vmstate_pciemu_mmio = {
+	.name = "pciemu-mmio",
+	.version_id = 1,
+	.minimum_version_id = 1,
+	.fields = (const VMStateField[]) {
+		VMSTATE_BUFFER_POINTER_UNSAFE(regs_page, PCIEMUMmio, 0,
+				PCIEMU_HW_BAR0_PAGE_SIZE),
+		VMSTATE_END_OF_LIST()
+	}
+};
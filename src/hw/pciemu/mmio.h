@@ -9,17 +9,57 @@
 #ifndef PCIEMU_MMIO_H
 #define PCIEMU_MMIO_H
 
-#include "pciemu.h"
+#include "qemu/osdep.h"
+#include "exec/memory.h"
+#include "qemu/event_notifier.h"
+#include "pciemu_hw.h"
 
 /* forward declaration (defined in pciemu.h) to avoid circular reference */
 typedef struct PCIEMUDevice PCIEMUDevice;
 
+/* function block of BAR0, mapped on its own page (PCIEMU_HW_BAR0_PAGE_*) */
+typedef struct PCIEMUMmioBlock {
+	PCIEMUDevice *dev;
+	MemoryRegion mr;
+	hwaddr base; /* offset of the block inside BAR0 */
+} PCIEMUMmioBlock;
+
+typedef struct PCIEMUMmio {
+	MemoryRegion bar; /* BAR 0, container of the blocks */
+	void *regs_page; /* backing memory of the regs block */
+	PCIEMUMmioBlock block[PCIEMU_HW_BAR0_PAGE_CNT];
+	EventNotifier doorbell; /* ioeventfd of the doorbell page */
+	bool doorbell_ioeventfd;
+} PCIEMUMmio;
+
+/* register access handlers */
+typedef uint64_t (*PCIEMUMmioReadFn)(PCIEMUDevice *dev, hwaddr addr);
+typedef void (*PCIEMUMmioWriteFn)(PCIEMUDevice *dev, hwaddr addr,
+		uint64_t val);
+
+/* entry of the BAR0 register table (see PCIEMU_HW_BAR0_REGS) */
+typedef struct PCIEMUMmioReg {
+	const char *name;
+	hwaddr offset;
+	unsigned int width;
+	unsigned int access;
+	uint64_t reset;
+	PCIEMUMmioReadFn read;
+	PCIEMUMmioWriteFn write;
+} PCIEMUMmioReg;
+
 void pciemu_mmio_reset(PCIEMUDevice *dev);
 
 void pciemu_mmio_init(PCIEMUDevice *dev, Error **errp);
 
 void pciemu_mmio_fini(PCIEMUDevice *dev);
 
+void pciemu_mmio_finalize(PCIEMUDevice *dev);
+
+void pciemu_mmio_doorbell_flush(PCIEMUDevice *dev);
+
+extern const VMStateDescription vmstate_pciemu_mmio;
+
 extern const MemoryRegionOps pciemu_mmio_ops;
 
 #endif /* PCIEMU_MMIO_H */
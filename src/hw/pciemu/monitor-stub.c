@@ -0,0 +1,36 @@
+/* monitor-stub.c - QMP/HMP commands when the PCIEMU device is not built
+ *
+ * The QAPI schema is shared by every target, so targets without
+ * CONFIG_PCIEMU still need the command handlers to link.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "monitor/hmp.h"
+#include "monitor/monitor.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-pciemu.h"
+
+PciemuInfoList *qmp_query_pciemu(Error **errp)
+{
+	return NULL;
+}
+
+void hmp_info_pciemu(Monitor *mon, const QDict *qdict)
+{
+	monitor_printf(mon, "No pciemu device\n");
+}
+
+void qmp_pciemu_snapshot(const char *id, const char *filename, Error **errp)
+{
+	error_setg(errp, "pciemu device '%s' not found", id);
+}
+
+void qmp_pciemu_restore(const char *id, const char *filename, Error **errp)
+{
+	error_setg(errp, "pciemu device '%s' not found", id);
+}
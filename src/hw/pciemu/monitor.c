@@ -0,0 +1,205 @@
+/* monitor.c - QMP/HMP commands of the PCIEMU device
+ *
+ *   - query-pciemu (QMP) : performance counters of every pciemu device
+ *   - info pciemu (HMP)  : the same, human readable
+ *   - pciemu-snapshot/pciemu-restore (QMP) : device state to/from a file
+ *
+ * The QAPI schema (pciemu.json) and the HMP command (hmp-commands-info.hx)
+ * are plugged into QEMU by setup.sh.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "monitor/hmp.h"
+#include "monitor/monitor.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-pciemu.h"
+#include "qom/object.h"
+#include "pciemu.h"
+#include "snapshot.h"
+#include "stats.h"
+
+/* -----------------------------------------------------------------------------
+ *  Private
+ * -----------------------------------------------------------------------------
+ */
+
+#define PCIEMU_MONITOR_MMIO_REG(_name, _offset, _width, _access, _reset) \
+	(_offset),
+
+static const hwaddr pciemu_monitor_mmio_regs[] = {
+	PCIEMU_HW_BAR0_REGS(PCIEMU_MONITOR_MMIO_REG)
+};
+
+static PciemuInfo *pciemu_monitor_info(PCIEMUDevice *dev)
+{
+	PCIEMUStats *stats = &dev->stats;
+	PciemuInfo *info = g_new0(PciemuInfo, 1);
+	PciemuMmioCounterList **tail = &info->mmio;
+	PciemuMmioCounter *mmio;
+	hwaddr addr;
+
+	info->path = object_get_canonical_path(OBJECT(dev));
+	if (DEVICE(dev)->id)
+		info->id = g_strdup(DEVICE(dev)->id);
+
+	for (int i = 0; i < ARRAY_SIZE(pciemu_monitor_mmio_regs); ++i) {
+		addr = pciemu_monitor_mmio_regs[i];
+		/* the regs page is RAM: guest accesses are not trapped */
+		if (addr < PCIEMU_HW_BAR0_PAGE(PCIEMU_HW_BAR0_PAGE_REGS + 1))
+			continue;
+		mmio = g_new0(PciemuMmioCounter, 1);
+		mmio->offset = addr;
+		mmio->reads = stat64_get(
+				&stats->mmio_reads[PCIEMU_HW_REG_SLOT(addr)]);
+		mmio->writes = stat64_get(
+				&stats->mmio_writes[PCIEMU_HW_REG_SLOT(addr)]);
+		QAPI_LIST_APPEND(tail, mmio);
+	}
+
+	info->doorbells = stat64_get(&stats->doorbells);
+	info->dma_bytes_to_device = stat64_get(&stats->dma_bytes_to_device);
+	info->dma_bytes_from_device = stat64_get(&stats->dma_bytes_from_device);
+	info->dma_errors = stat64_get(&stats->dma_errors);
+	info->irqs_raised = stat64_get(&stats->irqs_raised);
+	info->proxy_msgs_sent = stat64_get(&stats->proxy_msgs_sent);
+	info->proxy_msgs_received = stat64_get(&stats->proxy_msgs_recv);
+	info->proxy_bytes_sent = stat64_get(&stats->proxy_bytes_sent);
+	info->proxy_bytes_received = stat64_get(&stats->proxy_bytes_recv);
+	info->proxy_queue_depth = qatomic_read(&stats->proxy_queue_depth);
+	info->proxy_queue_high_water_mark = stat64_get(&stats->proxy_queue_hwm);
+
+	return info;
+}
+
+static int pciemu_monitor_query_one(Object *obj, void *opaque)
+{
+	PciemuInfoList ***tail = opaque;
+	PCIEMUDevice *dev;
+
+	if (!object_dynamic_cast(obj, TYPE_PCIEMU_DEVICE))
+		return 0;
+
+	dev = PCIEMU(obj);
+	if (!DEVICE(dev)->realized)
+		return 0;
+
+	QAPI_LIST_APPEND(*tail, pciemu_monitor_info(dev));
+	return 0;
+}
+
+static PCIEMUDevice *pciemu_monitor_find(const char *id, Error **errp)
+{
+	Object *obj;
+
+	obj = object_resolve_path_type(id, TYPE_PCIEMU_DEVICE, NULL);
+	if (!obj || !DEVICE(obj)->realized) {
+		error_setg(errp, "pciemu device '%s' not found", id);
+		return NULL;
+	}
+	return PCIEMU(obj);
+}
+
+/* -----------------------------------------------------------------------------
+ *  Public
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * qmp_query_pciemu: QMP query-pciemu command
+ *
+ * @errp: pointer to indicate errors
+ */
+PciemuInfoList *qmp_query_pciemu(Error **errp)
+{
+	PciemuInfoList *head = NULL, **tail = &head;
+
+	object_child_foreach_recursive(object_get_root(),
+			pciemu_monitor_query_one, &tail);
+	return head;
+}
+
+/**
+ * hmp_info_pciemu: HMP info pciemu command
+ *
+ * @mon: monitor printing the counters
+ * @qdict: command arguments (none)
+ */
+void hmp_info_pciemu(Monitor *mon, const QDict *qdict)
+{
+	PciemuInfoList *list, *elem;
+	PciemuMmioCounterList *mmio;
+	PciemuInfo *info;
+
+	list = qmp_query_pciemu(NULL);
+	if (!list) {
+		monitor_printf(mon, "No pciemu device\n");
+		return;
+	}
+
+	for (elem = list; elem; elem = elem->next) {
+		info = elem->value;
+		monitor_printf(mon, "%s (%s)\n", info->id ? info->id : "-",
+				info->path);
+		monitor_printf(mon, "  mmio:\n");
+		for (mmio = info->mmio; mmio; mmio = mmio->next)
+			monitor_printf(mon, "    0x%04" PRIx64 ": reads %" PRIu64
+					" writes %" PRIu64 "\n",
+					mmio->value->offset, mmio->value->reads,
+					mmio->value->writes);
+		monitor_printf(mon, "  doorbells: %" PRIu64 "\n",
+				info->doorbells);
+		monitor_printf(mon, "  dma: to-device %" PRIu64 " bytes, "
+				"from-device %" PRIu64 " bytes, errors %"
+				PRIu64 "\n", info->dma_bytes_to_device,
+				info->dma_bytes_from_device, info->dma_errors);
+		monitor_printf(mon, "  irqs raised: %" PRIu64 "\n",
+				info->irqs_raised);
+		monitor_printf(mon, "  proxy: sent %" PRIu64 " msgs (%" PRIu64
+				" bytes), received %" PRIu64 " msgs (%" PRIu64
+				" bytes)\n", info->proxy_msgs_sent,
+				info->proxy_bytes_sent,
+				info->proxy_msgs_received,
+				info->proxy_bytes_received);
+		monitor_printf(mon, "  proxy queue: depth %" PRIu64
+				", high-water mark %" PRIu64 "\n",
+				info->proxy_queue_depth,
+				info->proxy_queue_high_water_mark);
+	}
+
+	qapi_free_PciemuInfoList(list);
+}
+
+/**
+ * qmp_pciemu_snapshot: QMP pciemu-snapshot command
+ *
+ * @id: device id or QOM path
+ * @filename: snapshot file
+ * @errp: pointer to indicate errors
+ */
+void qmp_pciemu_snapshot(const char *id, const char *filename, Error **errp)
+{
+	PCIEMUDevice *dev = pciemu_monitor_find(id, errp);
+
+	if (dev)
+		pciemu_snapshot_save(dev, filename, errp);
+}
+
+/**
+ * qmp_pciemu_restore: QMP pciemu-restore command
+ *
+ * @id: device id or QOM path
+ * @filename: snapshot file
+ * @errp: pointer to indicate errors
+ */
+void qmp_pciemu_restore(const char *id, const char *filename, Error **errp)
+{
+	PCIEMUDevice *dev = pciemu_monitor_find(id, errp);
+
+	if (dev)
+		pciemu_snapshot_restore(dev, filename, errp);
+}
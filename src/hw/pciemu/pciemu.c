@@ -14,13 +14,18 @@
  *
  */
 
+#include "compute.h"
 #include "dma.h"
 #include "irq.h"
 #include "mmio.h"
 #include "pciemu.h"
 #include "pciemu_hw.h"
 #include "proxy.h"
+#include "stats.h"
 #include "qom/object.h"
+#include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
+#include "qapi/error.h"
 
 /* -----------------------------------------------------------------------------
  *  Internal functions
@@ -40,6 +45,31 @@ static void pciemu_reset(PCIEMUDevice *dev)
 	pciemu_proxy_reset(dev);
 }
 
+/**
+ * pciemu_vm_state_change: Quiesce or resume the device with the VM
+ *
+ * DMA commands run from the main loop when the doorbell ioeventfd fires
+ * (or from the vCPU write without it), so a doorbell rung just before the
+ * vCPUs stopped may still be pending: it is run here. The proxy thread runs
+ * on its own and is paused here, without waiting on the peer, so the device
+ * state does not change while it is saved or loaded.
+ *
+ * @opaque: Instance of PCIEMUDevice object
+ * @running: whether the VM is starting or stopping
+ * @state: the new run state
+ */
+static void pciemu_vm_state_change(void *opaque, bool running, RunState state)
+{
+	PCIEMUDevice *dev = opaque;
+
+	if (running) {
+		pciemu_proxy_resume(dev);
+	} else {
+		pciemu_mmio_doorbell_flush(dev);
+		pciemu_proxy_pause(dev);
+	}
+}
+
 /* -----------------------------------------------------------------------------
  *  Object related functions
  * -----------------------------------------------------------------------------
@@ -49,7 +79,8 @@ static void pciemu_reset(PCIEMUDevice *dev)
  * pciemu_device_init: Device initialization
  *
  * Initializes the newly instantiated PCIEMUDevice object. This can be seen
- * as a constructor of the PCIEMUDevice.
+ * as a constructor of the PCIEMUDevice. If a block fails to initialize, the
+ * blocks initialized before it are finalized again.
  * Note that we receive a pointer for a PCIDevice, but, due to the OOP hack
  * done by the QEMU Object Model, we can easily cast to a PCIEMUDevice.
  *
@@ -58,11 +89,35 @@ static void pciemu_reset(PCIEMUDevice *dev)
  */
 static void pciemu_device_init(PCIDevice *pci_dev, Error **errp)
 {
+	ERRP_GUARD();
 	PCIEMUDevice *dev = PCIEMU_DEVICE(pci_dev);
+	pciemu_stats_init(dev, errp);
 	pciemu_irq_init(dev, errp);
+	if (*errp)
+		return;
 	pciemu_dma_init(dev, errp);
+	if (*errp)
+		goto err_dma_init;
 	pciemu_mmio_init(dev, errp);
+	if (*errp)
+		goto err_mmio_init;
 	pciemu_proxy_init(dev, errp);
+	if (*errp)
+		goto err_proxy_init;
+
+	/* incoming migration or -S: keep the proxy quiet until the VM runs */
+	if (!runstate_is_running())
+		pciemu_proxy_pause(dev);
+	dev->vm_change = qemu_add_vm_change_state_handler(pciemu_vm_state_change,
+			dev);
+	return;
+
+err_proxy_init:
+	pciemu_mmio_fini(dev);
+err_mmio_init:
+	pciemu_dma_fini(dev);
+err_dma_init:
+	pciemu_irq_fini(dev);
 }
 
 /**
@@ -78,10 +133,12 @@ static void pciemu_device_init(PCIDevice *pci_dev, Error **errp)
 static void pciemu_device_fini(PCIDevice *pci_dev)
 {
 	PCIEMUDevice *dev = PCIEMU_DEVICE(pci_dev);
+	qemu_del_vm_change_state_handler(dev->vm_change);
+	/* the proxy thread goes first: it uses the other blocks */
+	pciemu_proxy_fini(dev);
 	pciemu_irq_fini(dev);
 	pciemu_dma_fini(dev);
 	pciemu_mmio_fini(dev);
-	pciemu_proxy_fini(dev);
 }
 
 /**
@@ -102,6 +159,38 @@ static void pciemu_device_reset(DeviceState *dev)
  * -----------------------------------------------------------------------------
  */
 
+static int pciemu_pre_save(void *opaque)
+{
+	/* the VM is stopped, but a doorbell may still wait in its eventfd */
+	pciemu_mmio_doorbell_flush(opaque);
+	return 0;
+}
+
+/**
+ * pciemu_vmstate: Migration description
+ *
+ * Device memory (BAR 1) is RAM and migrates iteratively with guest RAM.
+ * The regs page of BAR 0 is a RAM device region, which RAM migration
+ * skips, so its contents travel here.
+ * The proxy configuration comes from the command line of the destination.
+ */
+static const VMStateDescription pciemu_vmstate = {
+	.name = TYPE_PCIEMU_DEVICE,
+	.version_id = 1,
+	.minimum_version_id = 1,
+	.pre_save = pciemu_pre_save,
+	.fields = (const VMStateField[]) {
+		VMSTATE_PCI_DEVICE(pci_dev, PCIEMUDevice),
+		VMSTATE_STRUCT(irq, PCIEMUDevice, 0, vmstate_pciemu_irq,
+				IRQStatus),
+		VMSTATE_STRUCT(dma, PCIEMUDevice, 0, vmstate_pciemu_dma,
+				DMAEngine),
+		VMSTATE_STRUCT(mmio, PCIEMUDevice, 0, vmstate_pciemu_mmio,
+				PCIEMUMmio),
+		VMSTATE_END_OF_LIST()
+	}
+};
+
 /**
  * pciemu_class_init: Class initialization
  *
@@ -127,6 +216,15 @@ static void pciemu_class_init(ObjectClass *klass, void *class_data)
 	set_bit(DEVICE_CATEGORY_MISC, device_class->categories);
 	device_class->desc = PCIEMU_DEVICE_DESC;
 	device_class->reset = pciemu_device_reset;
+	device_class->vmsd = &pciemu_vmstate;
+}
+
+/**
+ * pciemu_get_compute_impl: Getter of the compute-impl property
+ */
+static char *pciemu_get_compute_impl(Object *obj, Error **errp)
+{
+	return g_strdup(pciemu_compute_impl_name());
 }
 
 /**
@@ -135,6 +233,7 @@ static void pciemu_class_init(ObjectClass *klass, void *class_data)
 static void pciemu_instance_init(Object *obj)
 {
 	PCIEMUDevice *dev = PCIEMU(obj);
+	g_autofree char *runtime_dir = NULL;
 
 	dev->proxy.server_mode = true;
 	object_property_add_bool(obj, "server_mode", pciemu_proxy_get_mode,
@@ -143,6 +242,91 @@ static void pciemu_instance_init(Object *obj)
 	dev->proxy.port = PCIEMU_PROXY_PORT;
 	object_property_add_uint16_ptr(obj, "port", &dev->proxy.port,
 			OBJ_PROP_FLAG_READWRITE);
+
+	/* link transport: tcp uses host and port, unix the socket path and
+	 * vsock the cid (of the server, for a client) and port */
+	dev->proxy.transport = PCIEMU_PROXY_TCP;
+	object_property_add_str(obj, "transport", pciemu_proxy_get_transport,
+			pciemu_proxy_set_transport);
+	dev->proxy.host = g_strdup(PCIEMU_PROXY_HOST);
+	object_property_add_str(obj, "host", pciemu_proxy_get_host,
+			pciemu_proxy_set_host);
+	runtime_dir = qemu_get_runtime_dir();
+	dev->proxy.path = g_build_filename(runtime_dir, PCIEMU_PROXY_PATH, NULL);
+	object_property_add_str(obj, "path", pciemu_proxy_get_path,
+			pciemu_proxy_set_path);
+	dev->proxy.cid = VMADDR_CID_HOST;
+	object_property_add_uint32_ptr(obj, "cid", &dev->proxy.cid,
+			OBJ_PROP_FLAG_READWRITE);
+
+	/* socket tunables of the link (see pciemu_proxy_sockopts) */
+	dev->proxy.nodelay = true;
+	object_property_add(obj, "nodelay", "bool", pciemu_proxy_get_flag,
+			pciemu_proxy_set_flag, NULL, &dev->proxy.nodelay);
+	object_property_add(obj, "quickack", "bool", pciemu_proxy_get_flag,
+			pciemu_proxy_set_flag, NULL, &dev->proxy.quickack);
+	object_property_add(obj, "keepalive", "bool", pciemu_proxy_get_flag,
+			pciemu_proxy_set_flag, NULL, &dev->proxy.keepalive);
+	object_property_add_uint32_ptr(obj, "sndbuf", &dev->proxy.sndbuf,
+			OBJ_PROP_FLAG_READWRITE);
+	object_property_add_uint32_ptr(obj, "rcvbuf", &dev->proxy.rcvbuf,
+			OBJ_PROP_FLAG_READWRITE);
+	object_property_add_uint32_ptr(obj, "busy-poll", &dev->proxy.busy_poll,
+			OBJ_PROP_FLAG_READWRITE);
+
+	/* link quality measured by the proxy heartbeat, in microseconds */
+	object_property_add(obj, "proxy-srtt-us", "uint64", pciemu_proxy_get_rtt,
+			NULL, NULL, &dev->proxy.srtt);
+	object_property_add(obj, "proxy-rttvar-us", "uint64",
+			pciemu_proxy_get_rtt, NULL, NULL, &dev->proxy.rttvar);
+
+	/* placement of the proxy thread (proxy-cpus wins over proxy-node) */
+	dev->proxy.node = -1;
+	object_property_add(obj, "proxy-node", "int32", pciemu_proxy_get_node,
+			pciemu_proxy_set_node, NULL, NULL);
+	object_property_add_str(obj, "proxy-cpus", pciemu_proxy_get_cpus,
+			pciemu_proxy_set_cpus);
+
+	/* optional backend of the device memory (see pciemu_dma_init) */
+	object_property_add_link(obj, "memdev", TYPE_MEMORY_BACKEND,
+			(Object **)&dev->dma.hostmem,
+			qdev_prop_allow_set_link_before_realize,
+			OBJ_PROP_LINK_STRONG);
+
+	/* DMA latency histograms (see stats.h) */
+	object_property_add(obj, "dma-latency-queue", "PciemuLatency",
+			pciemu_stats_get_latency, NULL, NULL,
+			(void *)(uintptr_t)PCIEMU_STATS_LAT_QUEUE);
+	object_property_add(obj, "dma-latency-exec", "PciemuLatency",
+			pciemu_stats_get_latency, NULL, NULL,
+			(void *)(uintptr_t)PCIEMU_STATS_LAT_EXEC);
+	object_property_add(obj, "dma-latency-notify", "PciemuLatency",
+			pciemu_stats_get_latency, NULL, NULL,
+			(void *)(uintptr_t)PCIEMU_STATS_LAT_NOTIFY);
+	object_property_add(obj, "dma-latency-guest", "PciemuLatency",
+			pciemu_stats_get_latency, NULL, NULL,
+			(void *)(uintptr_t)PCIEMU_STATS_LAT_GUEST);
+	object_property_add(obj, "dma-latency-total", "PciemuLatency",
+			pciemu_stats_get_latency, NULL, NULL,
+			(void *)(uintptr_t)PCIEMU_STATS_LAT_TOTAL);
+
+	/* kernels used by the compute commands (see compute.h) */
+	object_property_add_str(obj, "compute-impl", pciemu_get_compute_impl,
+			NULL);
+}
+
+/**
+ * pciemu_instance_finalize: Release what the properties allocated, and the
+ * memory of the regs block (see pciemu_mmio_finalize)
+ */
+static void pciemu_instance_finalize(Object *obj)
+{
+	PCIEMUDevice *dev = PCIEMU(obj);
+
+	pciemu_mmio_finalize(dev);
+	g_free(dev->proxy.cpus);
+	g_free(dev->proxy.host);
+	g_free(dev->proxy.path);
 }
 
 /* -----------------------------------------------------------------------------
@@ -170,6 +354,7 @@ static const TypeInfo pciemu_info = {
 	.parent = TYPE_PCI_DEVICE,
 	.instance_size = sizeof(PCIEMUDevice),
 	.instance_init = pciemu_instance_init,
+	.instance_finalize = pciemu_instance_finalize,
 	.class_init = pciemu_class_init,
 	.interfaces =
         (InterfaceInfo[]){
@@ -11,10 +11,13 @@
 #include "qemu/osdep.h"
 #include "hw/pci/pci.h"
 #include "hw/pci/pci_device.h"
+#include "sysemu/runstate.h"
 #include "pciemu_hw.h"
 #include "dma.h"
 #include "irq.h"
+#include "mmio.h"
 #include "proxy.h"
+#include "stats.h"
 
 #define TYPE_PCIEMU_DEVICE "pciemu"
 #define PCIEMU_DEVICE_DESC "PCIEMU Device"
@@ -50,13 +53,19 @@ typedef struct PCIEMUDevice {
 	DMAEngine dma;
 
 	/* Memory Regions */
-	MemoryRegion mmio; /* BAR 0 (registers) */
+	PCIEMUMmio mmio; /* BAR 0 (registers) */
 
-	/* Registers in BAR0 */
-	uint64_t reg[PCIEMU_HW_BAR0_REG_CNT];
+	/* Registers in BAR0, on the RAM backed page of mmio (regs page) */
+	uint64_t *reg;
 
 	/* Proxy thread information */
 	PCIEMUProxy proxy;
+
+	/* Quiesces the proxy while the VM is stopped (e.g. for migration) */
+	VMChangeStateEntry *vm_change;
+
+	/* Performance counters */
+	PCIEMUStats stats;
 } PCIEMUDevice;
 
 #endif /* PCIEMU_H */
@@ -9,17 +9,25 @@
 #include "pciemu.h"
 #include "pciemu_hw.h"
 #include "proxy.h"
+#include "stats.h"
+#include "qemu/cutils.h"
 #include "qemu/main-loop.h"
+#include "hw/qdev-properties.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "trace.h"
 #include "sysemu/sysemu.h"
 #include <linux/futex.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdatomic.h>
 #include <string.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 /* -----------------------------------------------------------------------------
@@ -29,26 +37,67 @@
 
 void qmp_system_reset(void *reason); /* forward declaration */
 
-static QEMUBH *pciemu_reset_bh, *pciemu_sync_bh;
+static const char *const pciemu_proxy_transports[] = {
+	[PCIEMU_PROXY_TCP] = "tcp",
+	[PCIEMU_PROXY_UNIX] = "unix",
+	[PCIEMU_PROXY_VSOCK] = "vsock",
+};
 
+/*
+ * The bottom halves below apply, from the main loop (BQL held), the effects
+ * of the requests received by the proxy thread. While the proxy is paused
+ * they leave the work pending and pciemu_proxy_resume() schedules them again.
+ */
 static void pciemu_proxy_reset_bh_handler(void *opaque)
 {
+	PCIEMUDevice *dev = opaque;
+
+	if (qatomic_read(&dev->proxy.paused) ||
+			!qatomic_xchg(&dev->proxy.reset_pending, false))
+		return;
 	qmp_system_reset(NULL); /* ver qemu/ui/gtk.c, línea 1313 */
 }
 
+static void pciemu_proxy_inta_bh_handler(void *opaque)
+{
+	PCIEMUDevice *dev = opaque;
+	int n;
+
+	if (qatomic_read(&dev->proxy.paused))
+		return;
+	for (n = qatomic_xchg(&dev->proxy.inta_pending, 0); n > 0; n--)
+		pciemu_irq_raise(dev, PCIEMU_HW_IRQ_FINI);
+}
+
+/* applies the data staged by the last sync; sync_lock protects it */
 static void pciemu_proxy_sync_bh_handler(void *opaque)
 {
 	PCIEMUDevice *dev = opaque;
 	DMAEngine *dma = &dev->dma;
+	void *conf, *buff;
+	uint64_t len;
 
-	if (!dev->proxy.tmp_conf || !dev->proxy.tmp_buff)
+	if (qatomic_read(&dev->proxy.paused))
 		return;
 
-	memcpy(&dma->config, dev->proxy.tmp_conf, sizeof(dma->config));
-	free(dev->proxy.tmp_conf);
+	qemu_mutex_lock(&dev->proxy.sync_lock);
+	conf = dev->proxy.tmp_conf;
+	buff = dev->proxy.tmp_buff;
+	len = dev->proxy.sync_len;
+	dev->proxy.tmp_conf = NULL;
+	dev->proxy.tmp_buff = NULL;
+	qemu_mutex_unlock(&dev->proxy.sync_lock);
 
-	memcpy(dma->buff, dev->proxy.tmp_buff, dma->config.txdesc.len);
-	free(dev->proxy.tmp_buff);
+	if (conf) {
+		memcpy(&dma->config, conf, sizeof(dma->config));
+		free(conf);
+	}
+
+	if (buff) {
+		memcpy(dma->buff, buff, len);
+		memory_region_set_dirty(dma->ram, 0, len);
+		free(buff);
+	}
 }
 
 /* No GLIBC definition for futex(2) */
@@ -94,319 +143,871 @@ void pciemu_proxy_ftx_post(uint32_t *ftx)
 
 }
 
-int pciemu_proxy_issue_sync(PCIEMUDevice *dev, int con)
+/* send(2)/recv(2) wrappers accounting the proxy traffic. A short transfer
+ * (timeout, closed link) leaves the stream unusable and is an error.
+ * Callers check for ret <= 0: 0 is a peer that closed the link. */
+static ssize_t pciemu_proxy_send(PCIEMUDevice *dev, int con, const void *buf,
+		size_t len)
+{
+	ssize_t ret;
+
+	ret = send(con, buf, len, 0);
+	if (ret > 0)
+		stat64_add(&dev->stats.proxy_bytes_sent, ret);
+
+	return ret == (ssize_t)len ? ret : -1;
+}
+
+static ssize_t pciemu_proxy_recv(PCIEMUDevice *dev, int con, void *buf,
+		size_t len)
+{
+	ssize_t ret;
+
+	ret = recv(con, buf, len, MSG_WAITALL);
+	if (ret > 0)
+		stat64_add(&dev->stats.proxy_bytes_recv, ret);
+
+	return ret == (ssize_t)len ? ret : -1;
+}
+
+/**
+ * pciemu_proxy_rtt_sample: Account a round trip time sample
+ *
+ * Smoothed RTT and RTT variation (jitter) are computed as in RFC 6298.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @rtt: sample, in microseconds
+ */
+static void pciemu_proxy_rtt_sample(PCIEMUDevice *dev, int64_t rtt)
+{
+	int64_t srtt, rttvar;
+
+	rtt = MAX(rtt, 0);
+	if (!dev->proxy.rtt_samples) {
+		srtt = rtt;
+		rttvar = rtt / 2;
+	} else {
+		srtt = stat64_get(&dev->proxy.srtt);
+		rttvar = stat64_get(&dev->proxy.rttvar);
+		rttvar = (3 * rttvar + ABS(srtt - rtt)) / 4;
+		srtt = (7 * srtt + rtt) / 8;
+	}
+	dev->proxy.rtt_samples++;
+	stat64_set(&dev->proxy.srtt, srtt);
+	stat64_set(&dev->proxy.rttvar, rttvar);
+	trace_pciemu_proxy_rtt(rtt, srtt, rttvar);
+}
+
+int pciemu_proxy_request(PCIEMUDevice *dev, int con, ProxyRequest req,
+		uint64_t seq)
 {
 	int ret;
-	dma_size_t len;
-	DMAConfig *config;
+	PCIEMUProxyHdr hdr = { .req = req, .seq = seq };
 
-	if (dev->dma.buff == NULL)
-		return PCIEMU_HANDLE_FAILURE;
+	ret = 0;
+	if (req != PCIEMU_REQ_NONE) {
+		ret = pciemu_proxy_send(dev, con, &hdr, sizeof(hdr));
+		stat64_add(&dev->stats.proxy_msgs_sent, 1);
+	}
 
-	len = dev->dma.config.txdesc.len;
-	ret = send(con, &len, sizeof(len));
-	if (ret < 0)
-		return PCIEMU_HANDLE_FAILURE;
+	return ret;
+}
 
-	ret = send(con, dev->dma.buff, sizeof(uint8_t)*len);
-	if (ret < 0)
-		return PCIEMU_HANDLE_FAILURE;
+int pciemu_proxy_handle_req(PCIEMUDevice *dev, int con, PCIEMUProxyHdr *hdr);
 
-	ret = pciemu_proxy_wait_reply(con, PCIEMU_REQ_ACK);
-	if (ret < 0)
-		return PCIEMU_HANDLE_FAILURE;
+/*
+ * Both ends may issue a request at the same time: requests received while
+ * waiting for the reply are handled in between.
+ */
+int pciemu_proxy_wait_reply(PCIEMUDevice *dev, int con, ProxyRequest rep,
+		uint64_t seq)
+{
+	int ret;
+	PCIEMUProxyHdr hdr;
 
-	free(dev->dma.buff);
-	dev->dma.buff = NULL;
+	do {
+		ret = pciemu_proxy_recv(dev, con, &hdr, sizeof(hdr));
+		if (ret <= 0)
+			return -1;
+		stat64_add(&dev->stats.proxy_msgs_recv, 1);
+		if (hdr.req == rep && hdr.seq == seq)
+			return ret;
+		if (hdr.req == PCIEMU_REQ_ACK || hdr.req == PCIEMU_REQ_PONG)
+			return -1;
+		ret = pciemu_proxy_handle_req(dev, con, &hdr);
+		trace_pciemu_proxy_req_handle(hdr.req, ret);
+	} while (ret == PCIEMU_HANDLE_SUCCESS);
 
-	return PCIEMU_HANDLE_SUCCESS;
+	return -1;
 }
 
-int pciemu_proxy_handle_sync(PCIEMUDevice *dev, int con)
+int pciemu_proxy_issue_sync(PCIEMUDevice *dev, int con)
 {
+	int ret;
 	dma_size_t len;
 
-	len = 0;
-	ret = recv(con, &len, sizeof(len), 0);
-	if (ret < 0)
+	if (dev->dma.buff == NULL)
 		return PCIEMU_HANDLE_FAILURE;
 
-	dev->dma.buff = malloc(sizeof(uint8_t)*len);
-	ret = recv(con, dev->dma.buff, sizeof(uint8_t)*len, 0);
+	len = dev->dma.config.txdesc.len;
+	trace_pciemu_proxy_sync_send(len);
+	ret = pciemu_proxy_send(dev, con, &len, sizeof(len));
 	if (ret < 0)
 		return PCIEMU_HANDLE_FAILURE;
 
-	/* qemu_bh_schedule(pciemu_sync_bh); */
-
-	ret = pciemu_proxy_request(con, PCIEMU_REQ_ACK);
+	ret = pciemu_proxy_send(dev, con, dev->dma.buff, sizeof(uint8_t)*len);
 	if (ret < 0)
 		return PCIEMU_HANDLE_FAILURE;
 
 	return PCIEMU_HANDLE_SUCCESS;
 }
 
-int pciemu_proxy_request(int con, ProxyRequest req)
+int pciemu_proxy_handle_sync(PCIEMUDevice *dev, int con)
 {
 	int ret;
+	dma_size_t len;
+	void *buff;
 
-	ret = 0;
-	if (req != PCIEMU_REQ_NONE)
-		ret = send(con, &req, sizeof(req), 0);
-
-	return ret;
-}
+	len = 0;
+	ret = pciemu_proxy_recv(dev, con, &len, sizeof(len));
+	if (ret <= 0 || len > PCIEMU_HW_DMA_AREA_SIZE)
+		return PCIEMU_HANDLE_FAILURE;
+	trace_pciemu_proxy_sync_recv(len);
+	if (!len)
+		return PCIEMU_HANDLE_SUCCESS;
 
-int pciemu_proxy_wait_reply(int con, ProxyRequest rep)
-{
-	int ret;
-	ProxyRequest req;
+	buff = malloc(sizeof(uint8_t)*len);
+	if (!buff)
+		return PCIEMU_HANDLE_FAILURE;
+	ret = pciemu_proxy_recv(dev, con, buff, sizeof(uint8_t)*len);
+	if (ret <= 0) {
+		free(buff);
+		return PCIEMU_HANDLE_FAILURE;
+	}
 
-	ret = recv(con, &req, sizeof(req), 0);
-	if (req != rep)
-		ret = -1;
+	/* device memory is guest visible (BAR 1): stage the data, the sync
+	 * bottom half copies it in from the main loop. A sync not applied
+	 * yet is superseded by this one */
+	qemu_mutex_lock(&dev->proxy.sync_lock);
+	free(dev->proxy.tmp_buff);
+	dev->proxy.tmp_buff = buff;
+	dev->proxy.sync_len = len;
+	qemu_mutex_unlock(&dev->proxy.sync_lock);
+	qemu_bh_schedule(dev->proxy.sync_bh);
 
-	return ret;
+	return PCIEMU_HANDLE_SUCCESS;
 }
 
-int pciemu_proxy_handle_req(PCIEMUDevice *dev, int con, ProxyRequest req)
+/*
+ * Requests already handled (seq not above rx_seq) are replays of a request
+ * whose reply was lost: they are acknowledged again but their side effects
+ * are not repeated. A sync only overwrites data, so it is applied again.
+ */
+int pciemu_proxy_handle_req(PCIEMUDevice *dev, int con, PCIEMUProxyHdr *hdr)
 {
 	int ret, ret_handle;
-	size_t len;
+	bool dup;
+	ProxyRequest rep;
+	int64_t stamp = 0;
 
+	dup = hdr->seq <= dev->proxy.rx_seq;
 	ret_handle = PCIEMU_HANDLE_SUCCESS;
-	switch (req) {
+	rep = PCIEMU_REQ_ACK;
+	switch (hdr->req) {
 	case PCIEMU_REQ_PING:
-		ret = pciemu_proxy_request(con, PCIEMU_REQ_PONG);
-		if (ret < 0)
-			ret_handle = PCIEMU_HANDLE_FAILURE;
+		if (pciemu_proxy_recv(dev, con, &stamp, sizeof(stamp)) <= 0)
+			return PCIEMU_HANDLE_FAILURE;
+		rep = PCIEMU_REQ_PONG;
 		break;
 	case PCIEMU_REQ_RESET:
-		qemu_bh_schedule(pciemu_reset_bh);
-		ret = pciemu_proxy_request(con, PCIEMU_REQ_ACK);
-		if (ret < 0)
-			ret_handle = PCIEMU_HANDLE_FAILURE;
+		if (!dup) {
+			qatomic_set(&dev->proxy.reset_pending, true);
+			qemu_bh_schedule(dev->proxy.reset_bh);
+		}
 		break;
 	case PCIEMU_REQ_QUIT:
-		ret = pciemu_proxy_request(con, PCIEMU_REQ_ACK);
-		if (ret < 0)
-			ret_handle = PCIEMU_HANDLE_FAILURE;
-		else
-			ret_handle = PCIEMU_HANDLE_FINISH;
+		ret_handle = PCIEMU_HANDLE_FINISH;
 		break;
 	case PCIEMU_REQ_INTA:
-		pciemu_irq_raise(dev, PCIEMU_HW_IRQ_FINI);
-		ret = pciemu_proxy_request(con, PCIEMU_REQ_ACK);
-		if (ret < 0)
-			ret_handle = PCIEMU_HANDLE_FAILURE;
+		if (!dup) {
+			qatomic_inc(&dev->proxy.inta_pending);
+			qemu_bh_schedule(dev->proxy.inta_bh);
+		}
 		break;
 	case PCIEMU_REQ_SYNC:
-		ret_handle = pciemu_proxy_handle_sync(dev, con);
+		if (pciemu_proxy_handle_sync(dev, con) == PCIEMU_HANDLE_FAILURE)
+			return PCIEMU_HANDLE_FAILURE;
 		break;
 	default:
-		ret_handle = PCIEMU_HANDLE_FAILURE;
+		return PCIEMU_HANDLE_FAILURE;
 	}
 
+	dev->proxy.rx_seq = MAX(dev->proxy.rx_seq, hdr->seq);
+	ret = pciemu_proxy_request(dev, con, rep, hdr->seq);
+	if (ret >= 0 && rep == PCIEMU_REQ_PONG)
+		ret = pciemu_proxy_send(dev, con, &stamp, sizeof(stamp));
+	if (ret < 0)
+		ret_handle = PCIEMU_HANDLE_FAILURE;
+
 	return ret_handle;
 }
 
 
-int pciemu_proxy_issue_req(PCIEMUDevice *dev, int con, ProxyRequest req)
+int pciemu_proxy_issue_req(PCIEMUDevice *dev, int con, ProxyRequest req,
+		uint64_t seq)
 {
-	int ret, ret_handle;
+	int ret;
+	ProxyRequest rep;
+	int64_t stamp;
 
-	ret_handle = PCIEMU_HANDLE_SUCCESS;
 	switch (req) {
 	case PCIEMU_REQ_PING:
-		ret = pciemu_proxy_request(con, req);
-		if (ret < 0) {
-			ret_handle = PCIEMU_HANDLE_FAILURE;
-			break;
-		}
-		ret = pciemu_proxy_wait_reply(con, PCIEMU_REQ_PONG);
-		if (ret < 0)
-			ret_handle = PCIEMU_HANDLE_FAILURE;
+		rep = PCIEMU_REQ_PONG;
 		break;
 	case PCIEMU_REQ_RESET:
 	case PCIEMU_REQ_INTA:
-		ret = pciemu_proxy_request(con, req);
-		if (ret < 0) {
-			ret_handle = PCIEMU_HANDLE_FAILURE;
-			break;
-		}
-		ret = pciemu_proxy_wait_reply(con, PCIEMU_REQ_ACK);
-		if (ret < 0)
-			ret_handle = PCIEMU_HANDLE_FAILURE;
-		break;
 	case PCIEMU_REQ_QUIT:
-		ret = pciemu_proxy_request(con, req);
-		if (ret < 0) {
-			ret_handle = PCIEMU_HANDLE_FAILURE;
-			break;
-		}
-		ret = pciemu_proxy_wait_reply(con, PCIEMU_REQ_ACK);
-		if (ret < 0)
-			ret_handle = PCIEMU_HANDLE_FAILURE;
-		else
-			ret_handle = PCIEMU_HANDLE_FINISH;
-		break;
 	case PCIEMU_REQ_SYNC:
-		ret = pciemu_proxy_request(con, req);
-		if (ret < 0) {
-			ret_handle = PCIEMU_HANDLE_FAILURE;
-			break;
-		}
-		ret_handle = pciemu_proxy_issue_sync(dev, con);
+		rep = PCIEMU_REQ_ACK;
 		break;
 	default:
-		ret_handle = PCIEMU_HANDLE_FAILURE;
+		/* the other end would not understand it: drop it */
+		return PCIEMU_HANDLE_SUCCESS;
 	}
 
-	return ret_handle;
+	ret = pciemu_proxy_request(dev, con, req, seq);
+	if (ret < 0)
+		return PCIEMU_HANDLE_FAILURE;
+
+	if (req == PCIEMU_REQ_PING) {
+		stamp = g_get_monotonic_time();
+		dev->proxy.ping_next = stamp + PCIEMU_PROXY_HEARTBEAT * 1000;
+		if (pciemu_proxy_send(dev, con, &stamp, sizeof(stamp)) < 0)
+			return PCIEMU_HANDLE_FAILURE;
+	}
+
+	if (req == PCIEMU_REQ_SYNC &&
+			pciemu_proxy_issue_sync(dev, con) == PCIEMU_HANDLE_FAILURE)
+		return PCIEMU_HANDLE_FAILURE;
+
+	ret = pciemu_proxy_wait_reply(dev, con, rep, seq);
+	if (ret < 0)
+		return PCIEMU_HANDLE_FAILURE;
+
+	if (rep == PCIEMU_REQ_PONG) {
+		if (pciemu_proxy_recv(dev, con, &stamp, sizeof(stamp)) <= 0)
+			return PCIEMU_HANDLE_FAILURE;
+		pciemu_proxy_rtt_sample(dev, g_get_monotonic_time() - stamp);
+	}
+
+	return req == PCIEMU_REQ_QUIT ? PCIEMU_HANDLE_FINISH :
+		PCIEMU_HANDLE_SUCCESS;
+}
+
+/*
+ * Waits while the proxy is paused, checked between exchanges. Returns false
+ * once pciemu_proxy_fini() stops the proxy.
+ */
+static bool pciemu_proxy_enter(PCIEMUDevice *dev)
+{
+	bool stop;
+
+	qemu_mutex_lock(&dev->proxy.pause_lock);
+	while (dev->proxy.paused && !dev->proxy.stop)
+		qemu_cond_wait(&dev->proxy.pause_cond, &dev->proxy.pause_lock);
+	stop = dev->proxy.stop;
+	qemu_mutex_unlock(&dev->proxy.pause_lock);
+	return !stop;
+}
+
+/*
+ * Publishes the socket of the link (-1 for none), so that pciemu_proxy_fini()
+ * can shut it down. Returns false if the proxy is already stopping.
+ */
+static bool pciemu_proxy_set_con(PCIEMUDevice *dev, int con)
+{
+	bool stop;
+
+	qemu_mutex_lock(&dev->proxy.pause_lock);
+	dev->proxy.con = con;
+	stop = dev->proxy.stop;
+	qemu_mutex_unlock(&dev->proxy.pause_lock);
+	return !stop;
+}
+
+/**
+ * pciemu_proxy_resume_session: Resume handshake, first exchange on a link
+ *
+ * Each end sends the session it belongs to and the sequence number of the
+ * last request it handled from the other end. A request left in flight
+ * by a dropped link is then either known to be handled (only its reply
+ * was lost) or issued again first, with the same sequence number.
+ * A different session means the other end restarted: its numbering
+ * starts over.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @con: connected socket
+ */
+static int pciemu_proxy_resume_session(PCIEMUDevice *dev, int con)
+{
+	PCIEMUProxyHdr hdr = {
+		.req = PCIEMU_REQ_RESUME,
+		.seq = dev->proxy.rx_seq,
+	};
+	uint64_t session = dev->proxy.session;
+
+	if (pciemu_proxy_send(dev, con, &hdr, sizeof(hdr)) < 0 ||
+			pciemu_proxy_send(dev, con, &session, sizeof(session)) < 0)
+		return PCIEMU_HANDLE_FAILURE;
+
+	if (pciemu_proxy_recv(dev, con, &hdr, sizeof(hdr)) <= 0 ||
+			hdr.req != PCIEMU_REQ_RESUME ||
+			pciemu_proxy_recv(dev, con, &session, sizeof(session)) <= 0)
+		return PCIEMU_HANDLE_FAILURE;
+
+	if (session != dev->proxy.peer_session) {
+		dev->proxy.peer_session = session;
+		dev->proxy.rx_seq = 0;
+	}
+	if (dev->proxy.inflight_req != PCIEMU_REQ_NONE &&
+			dev->proxy.inflight_seq <= hdr.seq)
+		dev->proxy.inflight_req = PCIEMU_REQ_NONE;
+	/* a ping replayed later would only give a bogus RTT */
+	if (dev->proxy.inflight_req == PCIEMU_REQ_PING)
+		dev->proxy.inflight_req = PCIEMU_REQ_NONE;
+
+	trace_pciemu_proxy_resume(session, hdr.seq, dev->proxy.inflight_req);
+	return PCIEMU_HANDLE_SUCCESS;
 }
 
 int pciemu_proxy_handle_connection(PCIEMUDevice *dev, int con)
 {
 	int ret, rret;
-	ProxyRequest req;
+	int notify = event_notifier_get_fd(&dev->proxy.req_notify);
+	int64_t wait;
+	PCIEMUProxyHdr hdr;
 	fd_set fds;
-	struct timeval timeout;
-
-	FD_ZERO(&fds);
-	bzero(&timeout, sizeof(timeout));
-	ret = PCIEMU_HANDLE_SUCCESS;
+	struct timeval timeout, dead = {
+		.tv_sec = PCIEMU_PROXY_DEAD / 1000,
+		.tv_usec = (PCIEMU_PROXY_DEAD % 1000) * 1000,
+	};
+
+	/* a peer silent for PCIEMU_PROXY_DEAD is dead: the blocked exchange
+	 * fails and the link is set up again */
+	if (setsockopt(con, SOL_SOCKET, SO_RCVTIMEO, &dead, sizeof(dead)) < 0 ||
+			setsockopt(con, SOL_SOCKET, SO_SNDTIMEO, &dead,
+				sizeof(dead)) < 0)
+		perror("setsockopt");
+	dev->proxy.ping_next = 0;
+
+	if (pciemu_proxy_enter(dev))
+		ret = pciemu_proxy_resume_session(dev, con);
+	else
+		ret = PCIEMU_HANDLE_FAILURE;
 
 	/* Comprobar peticiones */
 
-	do {
+	while (ret == PCIEMU_HANDLE_SUCCESS) {
+		if (!pciemu_proxy_enter(dev)) {
+			ret = PCIEMU_HANDLE_FAILURE;
+			break;
+		}
+		/* with nothing to send, sleep until a request is pushed,
+		 * the peer talks or the next heartbeat is due */
+		wait = 0;
+		if (dev->proxy.inflight_req == PCIEMU_REQ_NONE &&
+				TAILQ_EMPTY(&dev->proxy.req_head))
+			wait = MAX(dev->proxy.ping_next - g_get_monotonic_time(),
+					0);
+		timeout.tv_sec = wait / G_USEC_PER_SEC;
+		timeout.tv_usec = wait % G_USEC_PER_SEC;
+		FD_ZERO(&fds);
 		FD_SET(con, &fds);
-		rret = select(con+1, &fds, NULL, NULL, &timeout);
-		if (rret && FD_ISSET(con, &fds)) {
-			recv(con, &req, sizeof(req), MSG_WAITALL);
-			printf("Debug: Found a request on socket (%X)...", req);
-			ret = pciemu_proxy_handle_req(dev, con, req);
-			printf(" handled!\n");
+		FD_SET(notify, &fds);
+		rret = select(MAX(con, notify) + 1, &fds, NULL, NULL, &timeout);
+		if (rret > 0 && FD_ISSET(notify, &fds))
+			event_notifier_test_and_clear(&dev->proxy.req_notify);
+		if (rret > 0 && FD_ISSET(con, &fds)) {
+			if (pciemu_proxy_recv(dev, con, &hdr, sizeof(hdr)) <= 0) {
+				ret = PCIEMU_HANDLE_FAILURE;
+			} else {
+				stat64_add(&dev->stats.proxy_msgs_recv, 1);
+				ret = pciemu_proxy_handle_req(dev, con, &hdr);
+				trace_pciemu_proxy_req_handle(hdr.req, ret);
+			}
 		}
-		else if (!TAILQ_EMPTY(&dev->proxy.req_head)) {
-			req = pciemu_proxy_pop_req(dev);
-			printf("Debug: Popped a request on queue (%X)...", req);
-			ret = pciemu_proxy_issue_req(dev, con, req);
-			printf(" issued!\n");
+		else {
+			/* a request stays in flight until its reply arrives;
+			 * an idle link sends heartbeats */
+			if (dev->proxy.inflight_req != PCIEMU_REQ_NONE) {
+				/* issued again */
+			} else if (!TAILQ_EMPTY(&dev->proxy.req_head)) {
+				dev->proxy.inflight_req = pciemu_proxy_pop_req(dev);
+				dev->proxy.inflight_seq = ++dev->proxy.tx_seq;
+			} else if (g_get_monotonic_time() >=
+					dev->proxy.ping_next) {
+				dev->proxy.inflight_req = PCIEMU_REQ_PING;
+				dev->proxy.inflight_seq = ++dev->proxy.tx_seq;
+			} else {
+				continue;
+			}
+			ret = pciemu_proxy_issue_req(dev, con,
+					dev->proxy.inflight_req,
+					dev->proxy.inflight_seq);
+			trace_pciemu_proxy_req_issue(dev->proxy.inflight_req, ret);
+			if (ret != PCIEMU_HANDLE_FAILURE)
+				dev->proxy.inflight_req = PCIEMU_REQ_NONE;
 		}
-	} while (ret == PCIEMU_HANDLE_SUCCESS);
+	}
 
-	printf("Debug: Closing connection\n");
+	trace_pciemu_proxy_disconnected(ret);
 
-	if (con)
-		close(con);
+	pciemu_proxy_set_con(dev, -1);
+	close(con);
 
 	return ret;
 }
 
+/**
+ * pciemu_proxy_parse_cpulist: Parse a CPU list ("0-3,8,10-11")
+ *
+ * @list: CPU list, in the format of the sysfs cpulist files
+ * @set: resulting CPU set
+ * @errp: pointer to indicate errors
+ */
+static bool pciemu_proxy_parse_cpulist(const char *list, cpu_set_t *set,
+		Error **errp)
+{
+	unsigned long first, last;
+	const char *p = list;
+
+	CPU_ZERO(set);
+	while (*p) {
+		if (qemu_strtoul(p, &p, 10, &first) < 0)
+			goto err;
+		last = first;
+		if (*p == '-' && qemu_strtoul(p + 1, &p, 10, &last) < 0)
+			goto err;
+		if (last < first || last >= CPU_SETSIZE)
+			goto err;
+		for (unsigned long cpu = first; cpu <= last; ++cpu)
+			CPU_SET(cpu, set);
+		if (*p == ',')
+			++p;
+		else if (*p)
+			goto err;
+	}
+	if (CPU_COUNT(set))
+		return true;
+err:
+	error_setg(errp, "invalid CPU list '%s'", list);
+	return false;
+}
+
+/**
+ * pciemu_proxy_init_cpuset: Compute the CPUs the proxy thread runs on
+ *
+ * proxy-cpus takes precedence over proxy-node, whose CPUs are read from
+ * sysfs. Without either, the thread is not pinned.
+ *
+ * @dev: Instance of PCIEMUDevice object being initialized
+ * @errp: pointer to indicate errors
+ */
+static bool pciemu_proxy_init_cpuset(PCIEMUDevice *dev, Error **errp)
+{
+	g_autofree char *path = NULL, *list = NULL;
+
+	dev->proxy.pinned = false;
+	if (dev->proxy.cpus) {
+		if (!pciemu_proxy_parse_cpulist(dev->proxy.cpus,
+					&dev->proxy.cpuset, errp))
+			return false;
+	} else if (dev->proxy.node >= 0) {
+		path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist",
+				dev->proxy.node);
+		if (!g_file_get_contents(path, &list, NULL, NULL)) {
+			error_setg(errp, "host NUMA node %d not found",
+					dev->proxy.node);
+			return false;
+		}
+		if (!pciemu_proxy_parse_cpulist(g_strstrip(list),
+					&dev->proxy.cpuset, errp))
+			return false;
+	} else {
+		return true;
+	}
+
+	dev->proxy.pinned = true;
+	return true;
+}
+
+/**
+ * pciemu_proxy_start_thread: Start the proxy thread, joined by pciemu_proxy_fini
+ *
+ * @dev: Instance of PCIEMUDevice object being initialized
+ * @routine: server or client routine
+ * @errp: pointer to indicate errors
+ */
+static bool pciemu_proxy_start_thread(PCIEMUDevice *dev,
+		void *(*routine)(void *), Error **errp)
+{
+	int ret;
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	if (dev->proxy.pinned) {
+		ret = pthread_attr_setaffinity_np(&attr,
+				sizeof(dev->proxy.cpuset), &dev->proxy.cpuset);
+		if (ret) {
+			/* only pinned on request (proxy-cpus or proxy-node) */
+			error_setg_errno(errp, ret,
+					"could not pin the proxy thread");
+			pthread_attr_destroy(&attr);
+			return false;
+		}
+	}
+
+	ret = pthread_create(&dev->proxy.proxy_thread, &attr, routine, dev);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		error_setg_errno(errp, ret, "could not start the proxy thread");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * pciemu_proxy_resolve: Build the address of the link
+ *
+ * The server binds it and the client connects to it. A vsock server
+ * accepts connections for any CID of this end.
+ *
+ * @dev: Instance of PCIEMUDevice object being initialized
+ * @errp: pointer to indicate errors
+ */
+static bool pciemu_proxy_resolve(PCIEMUDevice *dev, Error **errp)
+{
+	struct addrinfo hints, *res;
+	struct sockaddr_un *sun;
+	struct sockaddr_vm *svm;
+	char port[8];
+	int ret;
+
+	bzero(&dev->proxy.addr, sizeof(dev->proxy.addr));
+
+	switch (dev->proxy.transport) {
+	case PCIEMU_PROXY_TCP:
+		bzero(&hints, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		snprintf(port, sizeof(port), "%u", dev->proxy.port);
+		ret = getaddrinfo(dev->proxy.host, port, &hints, &res);
+		if (ret) {
+			error_setg(errp, "proxy host %s: %s", dev->proxy.host,
+					gai_strerror(ret));
+			return false;
+		}
+		memcpy(&dev->proxy.addr, res->ai_addr, res->ai_addrlen);
+		dev->proxy.addrlen = res->ai_addrlen;
+		freeaddrinfo(res);
+		break;
+	case PCIEMU_PROXY_UNIX:
+		sun = (struct sockaddr_un *)&dev->proxy.addr;
+		if (strlen(dev->proxy.path) >= sizeof(sun->sun_path)) {
+			error_setg(errp, "proxy path %s too long", dev->proxy.path);
+			return false;
+		}
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, dev->proxy.path);
+		dev->proxy.addrlen = sizeof(*sun);
+		break;
+	case PCIEMU_PROXY_VSOCK:
+		svm = (struct sockaddr_vm *)&dev->proxy.addr;
+		svm->svm_family = AF_VSOCK;
+		svm->svm_port = dev->proxy.port;
+		svm->svm_cid = dev->proxy.server_mode ? VMADDR_CID_ANY :
+			dev->proxy.cid;
+		dev->proxy.addrlen = sizeof(*svm);
+		break;
+	}
+
+	return true;
+}
+
+/**
+ * pciemu_proxy_sockopts: Apply the socket tunables
+ *
+ * Buffer sizes apply to every transport. No Nagle delay and quick acks
+ * for the small request/reply messages, busy polling and keepalive only
+ * apply to TCP.
+ * Called on the client socket before connect and on the listening and
+ * accepted server sockets, so buffers are set before the window scale
+ * is negotiated. A failure is reported but does not drop the link.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @sockd: socket
+ */
+static void pciemu_proxy_sockopts(PCIEMUDevice *dev, int sockd)
+{
+	int val;
+
+	if (dev->proxy.sndbuf &&
+			setsockopt(sockd, SOL_SOCKET, SO_SNDBUF, &dev->proxy.sndbuf,
+				sizeof(dev->proxy.sndbuf)) < 0)
+		perror("setsockopt SO_SNDBUF");
+	if (dev->proxy.rcvbuf &&
+			setsockopt(sockd, SOL_SOCKET, SO_RCVBUF, &dev->proxy.rcvbuf,
+				sizeof(dev->proxy.rcvbuf)) < 0)
+		perror("setsockopt SO_RCVBUF");
+
+	if (dev->proxy.transport != PCIEMU_PROXY_TCP)
+		return;
+
+	val = dev->proxy.nodelay;
+	if (setsockopt(sockd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val)) < 0)
+		perror("setsockopt TCP_NODELAY");
+	if (dev->proxy.quickack) {
+		val = 1;
+		if (setsockopt(sockd, IPPROTO_TCP, TCP_QUICKACK, &val,
+					sizeof(val)) < 0)
+			perror("setsockopt TCP_QUICKACK");
+	}
+	if (dev->proxy.busy_poll &&
+			setsockopt(sockd, SOL_SOCKET, SO_BUSY_POLL,
+				&dev->proxy.busy_poll,
+				sizeof(dev->proxy.busy_poll)) < 0)
+		perror("setsockopt SO_BUSY_POLL");
+	if (dev->proxy.keepalive) {
+		val = 1;
+		if (setsockopt(sockd, SOL_SOCKET, SO_KEEPALIVE, &val,
+					sizeof(val)) < 0)
+			perror("setsockopt SO_KEEPALIVE");
+		val = PCIEMU_PROXY_KEEPIDLE;
+		setsockopt(sockd, IPPROTO_TCP, TCP_KEEPIDLE, &val, sizeof(val));
+		val = PCIEMU_PROXY_KEEPINTVL;
+		setsockopt(sockd, IPPROTO_TCP, TCP_KEEPINTVL, &val, sizeof(val));
+		val = PCIEMU_PROXY_KEEPCNT;
+		setsockopt(sockd, IPPROTO_TCP, TCP_KEEPCNT, &val, sizeof(val));
+	}
+}
+
+/* a new stream socket of the family of the link */
+static int pciemu_proxy_socket(PCIEMUDevice *dev)
+{
+	int sockd;
+
+	sockd = socket(dev->proxy.addr.ss_family, SOCK_STREAM, 0);
+	if (sockd < 0)
+		perror("socket");
+	else
+		pciemu_proxy_sockopts(dev, sockd);
+
+	return sockd;
+}
+
+/**
+ * pciemu_proxy_backoff: Wait before the next connection attempt
+ *
+ * The delay doubles with each failed attempt, from PCIEMU_PROXY_BACKOFF_MIN
+ * up to PCIEMU_PROXY_BACKOFF_MAX milliseconds, and is randomized in its
+ * upper half so that both ends do not retry in lockstep. Stopping the proxy
+ * cuts the wait short.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @attempt: number of failed attempts so far (>= 1)
+ */
+static void pciemu_proxy_backoff(PCIEMUDevice *dev, unsigned int attempt)
+{
+	unsigned int delay;
+	int64_t now, deadline;
+
+	delay = PCIEMU_PROXY_BACKOFF_MIN << MIN(attempt - 1, 16);
+	delay = MIN(delay, PCIEMU_PROXY_BACKOFF_MAX);
+	delay = delay / 2 + g_random_int_range(0, delay / 2 + 1);
+	trace_pciemu_proxy_backoff(attempt, delay);
+
+	deadline = g_get_monotonic_time() + delay * 1000;
+	qemu_mutex_lock(&dev->proxy.pause_lock);
+	while (!dev->proxy.stop && (now = g_get_monotonic_time()) < deadline)
+		qemu_cond_timedwait(&dev->proxy.pause_cond,
+				&dev->proxy.pause_lock, (deadline - now + 999) / 1000);
+	qemu_mutex_unlock(&dev->proxy.pause_lock);
+}
+
+/*
+ * The server keeps listening: a dropped link (or a failed accept) only
+ * waits for the other end to connect again. It ends when the proxy stops.
+ */
 static void *pciemu_proxy_server_routine (void *opaque)
 {
-	int con, ret;
+	int con;
+	unsigned int attempt;
 	socklen_t len;
-	struct sockaddr_in src;
+	struct sockaddr_storage src;
 
 	PCIEMUDevice *dev = opaque;
-	len = sizeof(src);
+	attempt = 0;
 
-	do {
+	while (!qatomic_read(&dev->proxy.stop)) {
+		len = sizeof(src);
 		con = accept(dev->proxy.sockd, (struct sockaddr *)&src, &len);
 		if (con < 0) {
+			if (qatomic_read(&dev->proxy.stop))
+				break;
 			perror("accept");
-			goto server_accept_err;
+			pciemu_proxy_backoff(dev, ++attempt);
+			continue;
 		}
-		printf("\nDebug: New client connected\n");
-		ret = pciemu_proxy_handle_connection(dev, con);
-	} while (ret != PCIEMU_HANDLE_FAILURE);
+		if (!pciemu_proxy_set_con(dev, con)) {
+			close(con);
+			break;
+		}
+		attempt = 0;
+		/* not every option is inherited from the listening socket */
+		pciemu_proxy_sockopts(dev, con);
+		trace_pciemu_proxy_connected(true);
+		pciemu_proxy_handle_connection(dev, con);
+	}
 
-	if (con)
-		close(con);
-	if (dev->proxy.sockd)
-		close(dev->proxy.sockd);
-server_accept_err:
 	pthread_exit(NULL);
 }
 
-void pciemu_proxy_init_server(PCIEMUDevice *dev)
+/**
+ * pciemu_proxy_unlink_stale: Remove a unix socket left by a previous run
+ *
+ * Such a file would make bind fail. Only a socket nobody listens on is
+ * removed: a live one means the path is in use, and anything else that is
+ * not a socket is left for bind to report.
+ *
+ * @dev: Instance of PCIEMUDevice object being initialized
+ * @errp: pointer to indicate errors
+ */
+static bool pciemu_proxy_unlink_stale(PCIEMUDevice *dev, Error **errp)
+{
+	struct stat st;
+	int sockd, ret;
+
+	if (lstat(dev->proxy.path, &st) < 0 || !S_ISSOCK(st.st_mode))
+		return true;
+
+	sockd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sockd < 0) {
+		error_setg_errno(errp, errno, "proxy socket");
+		return false;
+	}
+	ret = connect(sockd, (struct sockaddr *)&dev->proxy.addr,
+			dev->proxy.addrlen);
+	close(sockd);
+	if (!ret) {
+		error_setg(errp, "proxy path %s is already in use",
+				dev->proxy.path);
+		return false;
+	}
+
+	unlink(dev->proxy.path);
+	return true;
+}
+
+bool pciemu_proxy_init_server(PCIEMUDevice *dev, Error **errp)
 {
 	int ret;
 
 	/* Configurar socket */
 
+	if (dev->proxy.transport == PCIEMU_PROXY_UNIX &&
+			!pciemu_proxy_unlink_stale(dev, errp))
+		return false;
+
 	ret = bind(dev->proxy.sockd, (struct sockaddr *)&dev->proxy.addr,
-		sizeof(dev->proxy.addr));
+		dev->proxy.addrlen);
 	if (ret < 0) {
-		perror("bind");
-		return;
+		error_setg_errno(errp, errno, "proxy bind");
+		return false;
 	}
 
 	ret = listen(dev->proxy.sockd, PCIEMU_PROXY_MAXQ);
 	if (ret < 0) {
-		perror("listen");
-		return;
+		error_setg_errno(errp, errno, "proxy listen");
+		goto err_bound;
 	}
 
 	/* Inicializar thread */
 
-	ret = pthread_create(&dev->proxy.proxy_thread, NULL,
-			pciemu_proxy_server_routine, dev);
-	if (ret < 0) {
-		perror("pthread_create");
-		return;
-	}
+	if (!pciemu_proxy_start_thread(dev, pciemu_proxy_server_routine, errp))
+		goto err_bound;
+	return true;
 
-	ret = pthread_detach(dev->proxy.proxy_thread);
-	if (ret < 0) {
-		perror("pthread_detach");
-		return;
-	}
+err_bound:
+	if (dev->proxy.transport == PCIEMU_PROXY_UNIX)
+		unlink(dev->proxy.path);
+	return false;
 }
 
+/*
+ * The client connects again, with exponential backoff, whenever the link
+ * cannot be established or drops. A QUIT exchange or stopping the proxy
+ * ends it.
+ */
 static void *pciemu_proxy_client_routine (void *opaque)
 {
-	int ret;
+	int ret, con;
+	unsigned int attempt;
 
 	PCIEMUDevice *dev = opaque;
-
-	ret = connect(dev->proxy.sockd, (struct sockaddr *)&dev->proxy.addr,
-		sizeof(dev->proxy.addr));
-	if (ret < 0) {
-		perror("connect");
-		goto client_connect_err;
+	attempt = 0;
+
+	while (!qatomic_read(&dev->proxy.stop)) {
+		if (attempt)
+			pciemu_proxy_backoff(dev, attempt);
+		++attempt;
+
+		con = pciemu_proxy_socket(dev);
+		if (con < 0)
+			continue;
+		if (!pciemu_proxy_set_con(dev, con)) {
+			close(con);
+			break;
+		}
+		ret = connect(con, (struct sockaddr *)&dev->proxy.addr,
+				dev->proxy.addrlen);
+		if (ret < 0) {
+			pciemu_proxy_set_con(dev, -1);
+			close(con);
+			continue;
+		}
+		trace_pciemu_proxy_connected(false);
+		/* a link that drops right away still backs off once */
+		attempt = 1;
+		ret = pciemu_proxy_handle_connection(dev, con);
+		if (ret == PCIEMU_HANDLE_FINISH)
+			break;
 	}
-	printf("\nDebug: Connected to PCIEMU proxy server\n");
-	pciemu_proxy_handle_connection(dev, dev->proxy.sockd);
 
-client_connect_err:
 	pthread_exit(NULL);
 }
 
-void pciemu_proxy_init_client(PCIEMUDevice *dev)
+bool pciemu_proxy_init_client(PCIEMUDevice *dev, Error **errp)
 {
-	int ret;
-
-	/* Peticiones de muestra */
-
-	pciemu_proxy_push_req(dev, PCIEMU_REQ_PING);
-
-	/* Configurar socket (nada a hacer) */
+	/* Configurar socket (en cada intento de conexión) */
 
 	/* Inicializar thread */
 
-	ret = pthread_create(&dev->proxy.proxy_thread, NULL,
-			pciemu_proxy_client_routine, dev);
-	if (ret < 0) {
-		perror("pthread_create");
-		return;
-	}
+	return pciemu_proxy_start_thread(dev, pciemu_proxy_client_routine,
+			errp);
+}
 
-	ret = pthread_detach(dev->proxy.proxy_thread);
-	if (ret < 0) {
-		perror("pthread_detach");
-		return;
+/*
+ * The link is set up at realize and torn down with what it was set up with:
+ * its properties cannot change on a realized device.
+ */
+static bool pciemu_proxy_check_unrealized(Object *obj, const char *name,
+		Error **errp)
+{
+	if (DEVICE(obj)->realized) {
+		qdev_prop_set_after_realize(DEVICE(obj), name, errp);
+		return false;
 	}
+	return true;
 }
 
 
@@ -424,9 +1025,162 @@ bool pciemu_proxy_get_mode(Object *obj, Error **errp)
 void pciemu_proxy_set_mode(Object *obj, bool mode, Error **errp)
 {
 	PCIEMUDevice *dev = PCIEMU(obj);
+	if (!pciemu_proxy_check_unrealized(obj, "server_mode", errp))
+		return;
 	dev->proxy.server_mode = mode;
 }
 
+/**
+ * pciemu_proxy_pause: Quiesce the proxy
+ *
+ * Does not wait for the other end: the exchange in progress, if any, may
+ * complete, but its effects on the device stay pending in the bottom halves
+ * until pciemu_proxy_resume(), and the thread does not start another one
+ * meanwhile. Requests pushed meanwhile stay queued.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_proxy_pause(PCIEMUDevice *dev)
+{
+	qemu_mutex_lock(&dev->proxy.pause_lock);
+	qatomic_set(&dev->proxy.paused, true);
+	qemu_mutex_unlock(&dev->proxy.pause_lock);
+}
+
+/**
+ * pciemu_proxy_resume: Let the proxy handle requests again
+ *
+ * Also applies the effects left pending while paused.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_proxy_resume(PCIEMUDevice *dev)
+{
+	qemu_mutex_lock(&dev->proxy.pause_lock);
+	qatomic_set(&dev->proxy.paused, false);
+	qemu_cond_broadcast(&dev->proxy.pause_cond);
+	qemu_mutex_unlock(&dev->proxy.pause_lock);
+
+	qemu_bh_schedule(dev->proxy.sync_bh);
+	qemu_bh_schedule(dev->proxy.inta_bh);
+	qemu_bh_schedule(dev->proxy.reset_bh);
+}
+
+char *pciemu_proxy_get_transport(Object *obj, Error **errp)
+{
+	PCIEMUDevice *dev = PCIEMU(obj);
+	return g_strdup(pciemu_proxy_transports[dev->proxy.transport]);
+}
+
+void pciemu_proxy_set_transport(Object *obj, const char *name, Error **errp)
+{
+	PCIEMUDevice *dev = PCIEMU(obj);
+	int i;
+
+	if (!pciemu_proxy_check_unrealized(obj, "transport", errp))
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(pciemu_proxy_transports); i++) {
+		if (!strcmp(name, pciemu_proxy_transports[i])) {
+			dev->proxy.transport = i;
+			return;
+		}
+	}
+	error_setg(errp, "unknown proxy transport %s (tcp, unix, vsock)", name);
+}
+
+char *pciemu_proxy_get_host(Object *obj, Error **errp)
+{
+	PCIEMUDevice *dev = PCIEMU(obj);
+	return g_strdup(dev->proxy.host);
+}
+
+void pciemu_proxy_set_host(Object *obj, const char *host, Error **errp)
+{
+	PCIEMUDevice *dev = PCIEMU(obj);
+	if (!pciemu_proxy_check_unrealized(obj, "host", errp))
+		return;
+	g_free(dev->proxy.host);
+	dev->proxy.host = g_strdup(host);
+}
+
+char *pciemu_proxy_get_path(Object *obj, Error **errp)
+{
+	PCIEMUDevice *dev = PCIEMU(obj);
+	return g_strdup(dev->proxy.path);
+}
+
+void pciemu_proxy_set_path(Object *obj, const char *path, Error **errp)
+{
+	PCIEMUDevice *dev = PCIEMU(obj);
+	if (!pciemu_proxy_check_unrealized(obj, "path", errp))
+		return;
+	g_free(dev->proxy.path);
+	dev->proxy.path = g_strdup(path);
+}
+
+char *pciemu_proxy_get_cpus(Object *obj, Error **errp)
+{
+	PCIEMUDevice *dev = PCIEMU(obj);
+	return g_strdup(dev->proxy.cpus ? dev->proxy.cpus : "");
+}
+
+void pciemu_proxy_set_cpus(Object *obj, const char *cpus, Error **errp)
+{
+	PCIEMUDevice *dev = PCIEMU(obj);
+	cpu_set_t set;
+
+	if (*cpus && !pciemu_proxy_parse_cpulist(cpus, &set, errp))
+		return;
+	g_free(dev->proxy.cpus);
+	dev->proxy.cpus = *cpus ? g_strdup(cpus) : NULL;
+}
+
+void pciemu_proxy_get_node(Object *obj, Visitor *v, const char *name,
+		void *opaque, Error **errp)
+{
+	PCIEMUDevice *dev = PCIEMU(obj);
+	visit_type_int32(v, name, &dev->proxy.node, errp);
+}
+
+void pciemu_proxy_set_node(Object *obj, Visitor *v, const char *name,
+		void *opaque, Error **errp)
+{
+	PCIEMUDevice *dev = PCIEMU(obj);
+	int32_t node;
+
+	if (!visit_type_int32(v, name, &node, errp))
+		return;
+	if (node < -1) {
+		error_setg(errp, "invalid host NUMA node %" PRId32, node);
+		return;
+	}
+	dev->proxy.node = node;
+}
+
+/* getter and setter of a boolean property, opaque points to the flag */
+void pciemu_proxy_get_flag(Object *obj, Visitor *v, const char *name,
+		void *opaque, Error **errp)
+{
+	visit_type_bool(v, name, opaque, errp);
+}
+
+void pciemu_proxy_set_flag(Object *obj, Visitor *v, const char *name,
+		void *opaque, Error **errp)
+{
+	bool value;
+
+	if (visit_type_bool(v, name, &value, errp))
+		*(bool *)opaque = value;
+}
+
+void pciemu_proxy_get_rtt(Object *obj, Visitor *v, const char *name,
+		void *opaque, Error **errp)
+{
+	uint64_t value = stat64_get(opaque);
+	visit_type_uint64(v, name, &value, errp);
+}
+
 int pciemu_proxy_push_req(PCIEMUDevice *dev, ProxyRequest req)
 {
 	struct pciemu_proxy_req_entry *entry;
@@ -438,7 +1192,9 @@ int pciemu_proxy_push_req(PCIEMUDevice *dev, ProxyRequest req)
 	entry->req = req;
 	pciemu_proxy_ftx_wait(&dev->proxy.req_push_ftx);
 	TAILQ_INSERT_TAIL(&dev->proxy.req_head, entry, entries);
+	pciemu_stats_proxy_queue(dev, 1);
 	pciemu_proxy_ftx_post(&dev->proxy.req_pop_ftx);
+	event_notifier_set(&dev->proxy.req_notify);
 	return EXIT_SUCCESS;
 }
 
@@ -455,6 +1211,7 @@ ProxyRequest pciemu_proxy_pop_req(PCIEMUDevice *dev)
 	}
 
 	TAILQ_REMOVE(&dev->proxy.req_head, entry, entries);
+	pciemu_stats_proxy_queue(dev, -1);
 	pciemu_proxy_ftx_post(&dev->proxy.req_push_ftx);
 	req = entry->req;
 	free(entry);
@@ -466,45 +1223,124 @@ void pciemu_proxy_reset(PCIEMUDevice *dev)
 	return;
 }
 
+/* undoes the part of pciemu_proxy_init that does not involve the link */
+static void pciemu_proxy_cleanup(PCIEMUDevice *dev)
+{
+	g_clear_pointer(&dev->proxy.reset_bh, qemu_bh_delete);
+	g_clear_pointer(&dev->proxy.sync_bh, qemu_bh_delete);
+	g_clear_pointer(&dev->proxy.inta_bh, qemu_bh_delete);
+	free(dev->proxy.tmp_conf);
+	free(dev->proxy.tmp_buff);
+	dev->proxy.tmp_conf = NULL;
+	dev->proxy.tmp_buff = NULL;
+	event_notifier_cleanup(&dev->proxy.req_notify);
+	qemu_mutex_destroy(&dev->proxy.sync_lock);
+	qemu_cond_destroy(&dev->proxy.pause_cond);
+	qemu_mutex_destroy(&dev->proxy.pause_lock);
+}
+
 void pciemu_proxy_init(PCIEMUDevice *dev, Error **errp)
 {
-	struct hostent *h;
+	int ret;
 
-	pciemu_reset_bh = qemu_bh_new(pciemu_proxy_reset_bh_handler, NULL);
-	pciemu_sync_bh = qemu_bh_new(pciemu_proxy_sync_bh_handler, dev);
+	if (!pciemu_proxy_init_cpuset(dev, errp))
+		return;
 
 	/* Inicializar socket */
 
-	h = gethostbyname(PCIEMU_PROXY_HOST);
-	if (h == NULL) {
-		herror("gethostbyname");
+	if (!pciemu_proxy_resolve(dev, errp))
 		return;
-	}
 
-	dev->proxy.sockd = socket(AF_INET, SOCK_STREAM, 0);
-	if (dev->proxy.sockd < 0) {
-		perror("socket");
-		return;
+	qemu_mutex_init(&dev->proxy.pause_lock);
+	qemu_cond_init(&dev->proxy.pause_cond);
+	qemu_mutex_init(&dev->proxy.sync_lock);
+	dev->proxy.paused = false;
+	dev->proxy.reset_pending = false;
+	dev->proxy.inta_pending = 0;
+	dev->proxy.stop = false;
+	dev->proxy.con = -1;
+	dev->proxy.tmp_conf = NULL;
+	dev->proxy.tmp_buff = NULL;
+
+	dev->proxy.reset_bh = qemu_bh_new(pciemu_proxy_reset_bh_handler, dev);
+	dev->proxy.sync_bh = qemu_bh_new(pciemu_proxy_sync_bh_handler, dev);
+	dev->proxy.inta_bh = qemu_bh_new(pciemu_proxy_inta_bh_handler, dev);
+
+	ret = event_notifier_init(&dev->proxy.req_notify, 0);
+	if (ret < 0) {
+		error_setg_errno(errp, -ret, "proxy request notifier");
+		goto err_cleanup;
 	}
 
-	bzero(&dev->proxy.addr, sizeof(dev->proxy.addr));
-	dev->proxy.addr.sin_family = AF_INET;
-	dev->proxy.addr.sin_port = htons(dev->proxy.port);
-	dev->proxy.addr.sin_addr.s_addr = *(in_addr_t *)h->h_addr_list[0];
+	/* the client opens a new socket on each connection attempt */
+	if (dev->proxy.server_mode) {
+		dev->proxy.sockd = pciemu_proxy_socket(dev);
+		if (dev->proxy.sockd < 0) {
+			error_setg_errno(errp, errno, "proxy socket");
+			goto err_cleanup;
+		}
+	}
 
-	dev->proxy.tmp_buff = NULL;
 	TAILQ_INIT(&dev->proxy.req_head);
+	dev->proxy.session = ((uint64_t)g_random_int() << 32) | g_random_int();
+	dev->proxy.peer_session = 0;
+	dev->proxy.tx_seq = 0;
+	dev->proxy.rx_seq = 0;
+	dev->proxy.inflight_req = PCIEMU_REQ_NONE;
+	dev->proxy.rtt_samples = 0;
+	stat64_init(&dev->proxy.srtt, 0);
+	stat64_init(&dev->proxy.rttvar, 0);
 	dev->proxy.req_push_ftx = 1;
 	dev->proxy.req_pop_ftx = 0;
 
-	if (dev->proxy.server_mode)
-		pciemu_proxy_init_server(dev);
-	else
-		pciemu_proxy_init_client(dev);
+	if (dev->proxy.server_mode) {
+		if (!pciemu_proxy_init_server(dev, errp))
+			goto err_start;
+	} else if (!pciemu_proxy_init_client(dev, errp)) {
+		goto err_start;
+	}
+	return;
 
+err_start:
+	if (dev->proxy.server_mode)
+		close(dev->proxy.sockd);
+err_cleanup:
+	pciemu_proxy_cleanup(dev);
 }
 
+/**
+ * pciemu_proxy_fini: Stop the proxy thread and release the link
+ *
+ * The sockets are shut down so that a blocking accept, recv or send of the
+ * thread returns, and the thread is joined before anything it uses goes
+ * away. Requests still queued are dropped.
+ *
+ * @dev: Instance of PCIEMUDevice object being finalized
+ */
 void pciemu_proxy_fini(PCIEMUDevice *dev)
 {
-	return;
+	struct pciemu_proxy_req_entry *entry;
+
+	qemu_mutex_lock(&dev->proxy.pause_lock);
+	qatomic_set(&dev->proxy.stop, true);
+	if (dev->proxy.con >= 0)
+		shutdown(dev->proxy.con, SHUT_RDWR);
+	if (dev->proxy.server_mode)
+		shutdown(dev->proxy.sockd, SHUT_RDWR);
+	qemu_cond_broadcast(&dev->proxy.pause_cond);
+	qemu_mutex_unlock(&dev->proxy.pause_lock);
+
+	pthread_join(dev->proxy.proxy_thread, NULL);
+	if (dev->proxy.server_mode) {
+		close(dev->proxy.sockd);
+		if (dev->proxy.transport == PCIEMU_PROXY_UNIX)
+			unlink(dev->proxy.path);
+	}
+
+	while ((entry = TAILQ_FIRST(&dev->proxy.req_head))) {
+		TAILQ_REMOVE(&dev->proxy.req_head, entry, entries);
+		pciemu_stats_proxy_queue(dev, -1);
+		free(entry);
+	}
+	pciemu_proxy_cleanup(dev);
 }
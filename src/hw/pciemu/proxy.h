@@ -7,26 +7,51 @@
 #define PCIEMU_PROXY_H
 
 #include <pthread.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <sys/queue.h>
+#include <linux/vm_sockets.h>
 #include "qemu/typedefs.h"
+#include "qemu/event_notifier.h"
+#include "qemu/stats64.h"
+#include "qemu/thread.h"
 #include "qapi/qmp/qbool.h"
 
 #define PCIEMU_PROXY_HOST "localhost"
 #define PCIEMU_PROXY_PORT 8987
+/* default unix socket, in the runtime directory of the user */
+#define PCIEMU_PROXY_PATH "pciemu.sock"
 #define PCIEMU_PROXY_MAXQ 10
 #define PCIEMU_PROXY_BUFF 1024
+/* reconnection delay bounds, in milliseconds */
+#define PCIEMU_PROXY_BACKOFF_MIN 100
+#define PCIEMU_PROXY_BACKOFF_MAX 10000
+/* heartbeat period of an idle link and silence after which the other end
+ * is considered dead, in milliseconds */
+#define PCIEMU_PROXY_HEARTBEAT 500
+#define PCIEMU_PROXY_DEAD 2000
+/* TCP keepalive: idle time and probe interval (seconds), probes */
+#define PCIEMU_PROXY_KEEPIDLE 5
+#define PCIEMU_PROXY_KEEPINTVL 1
+#define PCIEMU_PROXY_KEEPCNT 3
 
 #define PCIEMU_REQ_NONE 0x00
 #define PCIEMU_REQ_ACK 0x01
-#define PCIEMU_REQ_PING 0x02
-#define PCIEMU_REQ_PONG 0x03
+#define PCIEMU_REQ_PING 0x02 /* + timestamp of the sender */
+#define PCIEMU_REQ_PONG 0x03 /* + timestamp of the ping */
 #define PCIEMU_REQ_RESET 0x04
 #define PCIEMU_REQ_QUIT 0x05
 #define PCIEMU_REQ_INTA 0x06
 #define PCIEMU_REQ_SYNC 0x07 /* this <- other */
 #define PCIEMU_REQ_SYNCME 0x08 /* this -> other */
 #define PCIEMU_REQ_RING 0x09
+#define PCIEMU_REQ_RESUME 0x0a /* handshake, first message on a link */
+
+/* link transports: TCP (host, port), UNIX domain socket (path) or
+ * vsock (cid, port) */
+#define PCIEMU_PROXY_TCP 0
+#define PCIEMU_PROXY_UNIX 1
+#define PCIEMU_PROXY_VSOCK 2
 
 #define PCIEMU_HANDLE_FAILURE -1
 #define PCIEMU_HANDLE_SUCCESS 0
@@ -40,6 +65,14 @@ typedef struct PCIEMUDevice PCIEMUDevice;
 
 typedef unsigned int ProxyRequest;
 
+/* header of every message. Requests carry the sequence number of the
+ * sender, replies (ACK, PONG) the one of the request they answer */
+typedef struct PCIEMUProxyHdr {
+	ProxyRequest req;
+	uint32_t reserved;
+	uint64_t seq;
+} PCIEMUProxyHdr;
+
 struct pciemu_proxy_req_entry {
 	ProxyRequest req;
 	TAILQ_ENTRY(pciemu_proxy_req_entry) entries;
@@ -51,11 +84,51 @@ struct pciemu_proxy {
 	pthread_t proxy_thread;
 	int sockd;
 	bool server_mode;
+	/* sync data staged for pciemu_proxy_sync_bh_handler (sync_lock) */
+	QemuMutex sync_lock;
 	void *tmp_conf, *tmp_buff;
+	uint64_t sync_len;
 	uint16_t port;
 	uint32_t req_push_ftx, req_pop_ftx;
-	struct sockaddr_in addr;
+	/* set on each push, wakes the thread idle in select */
+	EventNotifier req_notify;
+	/* transport and address of the link (see pciemu_proxy_resolve) */
+	int transport;
+	char *host, *path;
+	uint32_t cid;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	/* socket tunables (see pciemu_proxy_sockopts), 0 = system default */
+	bool nodelay, quickack, keepalive;
+	uint32_t sndbuf, rcvbuf, busy_poll;
 	struct pciemu_proxy_req_head req_head;
+	/* link resumption: see pciemu_proxy_resume_session */
+	uint64_t session, peer_session;
+	uint64_t tx_seq, rx_seq;
+	ProxyRequest inflight_req;
+	uint64_t inflight_seq;
+	/* heartbeat: time of the next ping and RTT, in microseconds */
+	int64_t ping_next;
+	uint64_t rtt_samples;
+	Stat64 srtt, rttvar;
+	/* quiesce: the thread only starts exchanges while not paused and
+	 * the bottom halves defer their effects while paused */
+	QemuMutex pause_lock;
+	QemuCond pause_cond;
+	bool paused;
+	/* set by pciemu_proxy_fini; con is the socket of the link, or -1
+	 * (both under pause_lock) */
+	bool stop;
+	int con;
+	/* received but not yet applied from the main loop, by these BHs */
+	bool reset_pending;
+	int inta_pending;
+	QEMUBH *reset_bh, *sync_bh, *inta_bh;
+	/* placement of the proxy thread: CPU list or host NUMA node */
+	char *cpus;
+	int32_t node;
+	cpu_set_t cpuset;
+	bool pinned;
 };
 
 typedef struct pciemu_proxy PCIEMUProxy;
@@ -67,6 +140,34 @@ void pciemu_proxy_fini(PCIEMUDevice *dev);
 bool pciemu_proxy_get_mode(Object *obj, Error **errp);
 void pciemu_proxy_set_mode(Object *obj, bool mode, Error **errp);
 
+char *pciemu_proxy_get_transport(Object *obj, Error **errp);
+void pciemu_proxy_set_transport(Object *obj, const char *name, Error **errp);
+
+char *pciemu_proxy_get_host(Object *obj, Error **errp);
+void pciemu_proxy_set_host(Object *obj, const char *host, Error **errp);
+
+char *pciemu_proxy_get_path(Object *obj, Error **errp);
+void pciemu_proxy_set_path(Object *obj, const char *path, Error **errp);
+
+char *pciemu_proxy_get_cpus(Object *obj, Error **errp);
+void pciemu_proxy_set_cpus(Object *obj, const char *cpus, Error **errp);
+
+void pciemu_proxy_get_node(Object *obj, Visitor *v, const char *name,
+		void *opaque, Error **errp);
+void pciemu_proxy_set_node(Object *obj, Visitor *v, const char *name,
+		void *opaque, Error **errp);
+
+void pciemu_proxy_get_flag(Object *obj, Visitor *v, const char *name,
+		void *opaque, Error **errp);
+void pciemu_proxy_set_flag(Object *obj, Visitor *v, const char *name,
+		void *opaque, Error **errp);
+
+void pciemu_proxy_get_rtt(Object *obj, Visitor *v, const char *name,
+		void *opaque, Error **errp);
+
+void pciemu_proxy_pause(PCIEMUDevice *dev);
+void pciemu_proxy_resume(PCIEMUDevice *dev);
+
 int pciemu_proxy_push_req(PCIEMUDevice *dev, ProxyRequest req);
 ProxyRequest pciemu_proxy_pop_req(PCIEMUDevice *dev);
 
@@ -0,0 +1,239 @@
+/* snapshot.c - Device state snapshot to/from a file
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "sysemu/runstate.h"
+#include "pciemu.h"
+#include "snapshot.h"
+#include "trace.h"
+
+#include <sys/mman.h>
+
+/* -----------------------------------------------------------------------------
+ *  Private
+ * -----------------------------------------------------------------------------
+ */
+
+#define PCIEMU_SNAPSHOT_SIZE \
+	(PCIEMU_SNAPSHOT_MEM_OFFSET + PCIEMU_HW_DMA_AREA_SIZE)
+
+/**
+ * pciemu_snapshot_check: Validate the header of a snapshot file
+ *
+ * @hdr: header read from the file
+ * @size: size of the file
+ * @errp: pointer to indicate errors
+ */
+static bool pciemu_snapshot_check(PCIEMUSnapshotHeader *hdr, off_t size,
+		Error **errp)
+{
+	if (memcmp(hdr->magic, PCIEMU_SNAPSHOT_MAGIC, sizeof(hdr->magic))) {
+		error_setg(errp, "not a pciemu snapshot");
+		return false;
+	}
+	if (hdr->version != PCIEMU_SNAPSHOT_VERSION) {
+		error_setg(errp, "unsupported snapshot version %u", hdr->version);
+		return false;
+	}
+	if (hdr->regs_offset != PCIEMU_SNAPSHOT_REGS_OFFSET ||
+			hdr->regs_size != PCIEMU_HW_BAR0_PAGE_SIZE ||
+			hdr->mem_offset != PCIEMU_SNAPSHOT_MEM_OFFSET ||
+			hdr->mem_size != PCIEMU_HW_DMA_AREA_SIZE) {
+		error_setg(errp, "snapshot layout does not match the device");
+		return false;
+	}
+	if (size < PCIEMU_SNAPSHOT_SIZE) {
+		error_setg(errp, "snapshot truncated");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * pciemu_snapshot_map_mem: Map the device memory of a snapshot
+ *
+ * Replaces the pages of the device memory with a private (copy-on-write)
+ * mapping of the file. The RAM block keeps its address, so the guest
+ * mapping of BAR 1 and KVM follow the new pages. Falls back to reading
+ * the file when the host page size does not allow it, or with memdev.
+ *
+ * @dev: Instance of PCIEMUDevice object being restored
+ * @fd: snapshot file
+ * @mapped: set when the memory was mapped rather than copied
+ */
+static int pciemu_snapshot_map_mem(PCIEMUDevice *dev, int fd, bool *mapped)
+{
+	DMAEngine *dma = &dev->dma;
+	size_t page = qemu_real_host_page_size();
+	void *ptr;
+
+	/* a memdev may be shared with the proxy peer: keep its mapping */
+	*mapped = false;
+	if (!dma->hostmem && QEMU_IS_ALIGNED((uintptr_t)dma->buff, page) &&
+			QEMU_IS_ALIGNED(PCIEMU_HW_DMA_AREA_SIZE, page) &&
+			QEMU_IS_ALIGNED(PCIEMU_SNAPSHOT_MEM_OFFSET, page)) {
+		ptr = mmap(dma->buff, PCIEMU_HW_DMA_AREA_SIZE,
+				PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+				fd, PCIEMU_SNAPSHOT_MEM_OFFSET);
+		if (ptr == dma->buff) {
+			*mapped = true;
+			return 0;
+		}
+	}
+
+	if (pread(fd, dma->buff, PCIEMU_HW_DMA_AREA_SIZE,
+			PCIEMU_SNAPSHOT_MEM_OFFSET) != PCIEMU_HW_DMA_AREA_SIZE)
+		return -1;
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ *  Public
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_snapshot_save: Save the device state into a file
+ *
+ * The state is written, through a shared mapping, to a new file next to
+ * @filename that is then renamed over it: a file restored earlier may still
+ * back the device memory (see pciemu_snapshot_map_mem), so it must never be
+ * truncated or rewritten in place. The proxy is paused meanwhile so that it
+ * does not change the device memory.
+ *
+ * @dev: Instance of PCIEMUDevice object being saved
+ * @filename: snapshot file
+ * @errp: pointer to indicate errors
+ */
+void pciemu_snapshot_save(PCIEMUDevice *dev, const char *filename,
+		Error **errp)
+{
+	DMAEngine *dma = &dev->dma;
+	PCIEMUSnapshotHeader *hdr;
+	g_autofree char *tmpname = g_strdup_printf("%s.XXXXXX", filename);
+	uint8_t *file;
+	int fd;
+
+	fd = g_mkstemp_full(tmpname, O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		error_setg_errno(errp, errno, "could not create '%s'", tmpname);
+		return;
+	}
+	if (ftruncate(fd, PCIEMU_SNAPSHOT_SIZE) < 0) {
+		error_setg_errno(errp, errno, "could not size '%s'", tmpname);
+		goto out_close;
+	}
+	file = mmap(NULL, PCIEMU_SNAPSHOT_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (file == MAP_FAILED) {
+		error_setg_errno(errp, errno, "could not map '%s'", tmpname);
+		goto out_close;
+	}
+
+	pciemu_proxy_pause(dev);
+
+	hdr = (PCIEMUSnapshotHeader *)file;
+	memcpy(hdr->magic, PCIEMU_SNAPSHOT_MAGIC, sizeof(hdr->magic));
+	hdr->version = PCIEMU_SNAPSHOT_VERSION;
+	hdr->regs_offset = PCIEMU_SNAPSHOT_REGS_OFFSET;
+	hdr->regs_size = PCIEMU_HW_BAR0_PAGE_SIZE;
+	hdr->mem_offset = PCIEMU_SNAPSHOT_MEM_OFFSET;
+	hdr->mem_size = PCIEMU_HW_DMA_AREA_SIZE;
+	hdr->txdesc_src = dma->config.txdesc.src;
+	hdr->txdesc_dst = dma->config.txdesc.dst;
+	hdr->txdesc_len = dma->config.txdesc.len;
+	hdr->cmd = dma->config.cmd;
+	hdr->result = dma->result;
+	hdr->status = dma->error ? PCIEMU_HW_DMA_STATUS_ERROR : 0;
+	memcpy(file + PCIEMU_SNAPSHOT_REGS_OFFSET, dev->mmio.regs_page,
+			PCIEMU_HW_BAR0_PAGE_SIZE);
+	memcpy(file + PCIEMU_SNAPSHOT_MEM_OFFSET, dma->buff,
+			PCIEMU_HW_DMA_AREA_SIZE);
+
+	if (runstate_is_running())
+		pciemu_proxy_resume(dev);
+
+	if (msync(file, PCIEMU_SNAPSHOT_SIZE, MS_SYNC) < 0) {
+		error_setg_errno(errp, errno, "could not write '%s'", tmpname);
+		munmap(file, PCIEMU_SNAPSHOT_SIZE);
+		goto out_close;
+	}
+	munmap(file, PCIEMU_SNAPSHOT_SIZE);
+	if (rename(tmpname, filename) < 0) {
+		error_setg_errno(errp, errno, "could not rename '%s' to '%s'",
+				tmpname, filename);
+		goto out_close;
+	}
+	qemu_close(fd);
+	trace_pciemu_snapshot_save(filename);
+	return;
+
+out_close:
+	qemu_close(fd);
+	unlink(tmpname);
+}
+
+/**
+ * pciemu_snapshot_restore: Restore the device state from a file
+ *
+ * The proxy link is left untouched: the other end is not resynced.
+ *
+ * @dev: Instance of PCIEMUDevice object being restored
+ * @filename: snapshot file
+ * @errp: pointer to indicate errors
+ */
+void pciemu_snapshot_restore(PCIEMUDevice *dev, const char *filename,
+		Error **errp)
+{
+	DMAEngine *dma = &dev->dma;
+	PCIEMUSnapshotHeader hdr;
+	struct stat st;
+	bool mapped;
+	int fd;
+
+	fd = qemu_open(filename, O_RDONLY, errp);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) < 0) {
+		error_setg_errno(errp, errno, "could not stat '%s'", filename);
+		goto out_close;
+	}
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		error_setg(errp, "could not read '%s'", filename);
+		goto out_close;
+	}
+	if (!pciemu_snapshot_check(&hdr, st.st_size, errp))
+		goto out_close;
+
+	pciemu_proxy_pause(dev);
+
+	if (pread(fd, dev->mmio.regs_page, PCIEMU_HW_BAR0_PAGE_SIZE,
+			PCIEMU_SNAPSHOT_REGS_OFFSET) != PCIEMU_HW_BAR0_PAGE_SIZE ||
+			pciemu_snapshot_map_mem(dev, fd, &mapped) < 0) {
+		error_setg(errp, "could not read '%s'", filename);
+		goto out_resume;
+	}
+	dma->buff_mapped |= mapped;
+	/* the pages changed behind the dirty bitmap */
+	memory_region_set_dirty(dma->ram, 0, PCIEMU_HW_DMA_AREA_SIZE);
+
+	dma->config.txdesc.src = hdr.txdesc_src;
+	dma->config.txdesc.dst = hdr.txdesc_dst;
+	dma->config.txdesc.len = hdr.txdesc_len;
+	dma->config.cmd = hdr.cmd;
+	dma->result = hdr.result;
+	dma->error = hdr.status & PCIEMU_HW_DMA_STATUS_ERROR;
+	trace_pciemu_snapshot_restore(filename, mapped);
+
+out_resume:
+	if (runstate_is_running())
+		pciemu_proxy_resume(dev);
+out_close:
+	qemu_close(fd);
+}
@@ -0,0 +1,63 @@
+/* snapshot.h - Device state snapshot to/from a file
+ *
+ * A snapshot holds the BAR0 registers, the DMA configuration and result,
+ * and the device memory. The file is laid out so that the device memory
+ * starts on a PCIEMU_SNAPSHOT_ALIGN boundary:
+ *
+ *   0x00000 : PCIEMUSnapshotHeader
+ *   0x01000 : BAR0 regs page (PCIEMU_HW_BAR0_PAGE_SIZE)
+ *   0x10000 : device memory (PCIEMU_HW_DMA_AREA_SIZE)
+ *
+ * On restore, the device memory is mapped copy-on-write (MAP_PRIVATE)
+ * from the file, so only the pages the guest touches afterwards are
+ * copied. Fields are stored in host byte order.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_SNAPSHOT_H
+#define PCIEMU_SNAPSHOT_H
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "pciemu_hw.h"
+
+#define PCIEMU_SNAPSHOT_MAGIC "PCIEMUSN"
+#define PCIEMU_SNAPSHOT_VERSION 1
+/* largest host page size supported (e.g. 64K pages on aarch64/ppc64) */
+#define PCIEMU_SNAPSHOT_ALIGN (64 * KiB)
+#define PCIEMU_SNAPSHOT_REGS_OFFSET PCIEMU_HW_BAR0_PAGE_SIZE
+#define PCIEMU_SNAPSHOT_MEM_OFFSET PCIEMU_SNAPSHOT_ALIGN
+
+/* forward declaration (defined in pciemu.h) to avoid circular reference */
+typedef struct PCIEMUDevice PCIEMUDevice;
+
+typedef struct PCIEMUSnapshotHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t regs_offset;
+	uint64_t regs_size;
+	uint64_t mem_offset;
+	uint64_t mem_size;
+	/* DMA engine */
+	uint64_t txdesc_src;
+	uint64_t txdesc_dst;
+	uint64_t txdesc_len;
+	uint64_t cmd;
+	uint64_t result;
+	/* DMA_STATUS (0 in snapshots taken before it existed: the header
+	 * page is zero filled) */
+	uint64_t status;
+} PCIEMUSnapshotHeader;
+
+void pciemu_snapshot_save(PCIEMUDevice *dev, const char *filename,
+		Error **errp);
+
+void pciemu_snapshot_restore(PCIEMUDevice *dev, const char *filename,
+		Error **errp);
+
+#endif /* PCIEMU_SNAPSHOT_H */
@@ -0,0 +1,273 @@
+/* stats.c - Device performance counters
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
+#include "qapi/visitor.h"
+#include "pciemu.h"
+#include "stats.h"
+
+/* -----------------------------------------------------------------------------
+ *  Private
+ * -----------------------------------------------------------------------------
+ */
+
+/* upper bound (in bytes) of each size class, the last one takes the rest */
+static const dma_size_t pciemu_stats_lat_size_limit[PCIEMU_STATS_LAT_SIZES - 1] = {
+	64, 256, 1024,
+};
+
+static const char *pciemu_stats_lat_size_name[PCIEMU_STATS_LAT_SIZES] = {
+	"64", "256", "1024", "larger",
+};
+
+static const char *pciemu_stats_lat_dir_name[PCIEMU_STATS_LAT_DIRS] = {
+	"to-device", "from-device",
+};
+
+/**
+ * pciemu_stats_lat_record: Account a latency into its histogram
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @phase: phase of the transfer being accounted
+ * @from: stamp starting the phase
+ * @to: stamp ending the phase
+ */
+static void pciemu_stats_lat_record(PCIEMUDevice *dev,
+		PCIEMUStatsLatPhase phase, PCIEMUStatsLatStamp from,
+		PCIEMUStatsLatStamp to)
+{
+	PCIEMUStatsLatTx *tx = &dev->stats.lat_tx;
+	int64_t ns;
+	int dir, size, bucket;
+
+	if (!tx->stamp[from] || !tx->stamp[to])
+		return;
+
+	if (tx->cmd == PCIEMU_HW_DMA_DIRECTION_TO_DEVICE)
+		dir = 0;
+	else if (tx->cmd == PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE)
+		dir = 1;
+	else
+		return;
+
+	for (size = 0; size < PCIEMU_STATS_LAT_SIZES - 1; ++size)
+		if (tx->len <= pciemu_stats_lat_size_limit[size])
+			break;
+
+	ns = tx->stamp[to] - tx->stamp[from];
+	bucket = ns > 0 ? 63 - clz64(ns) : 0;
+	bucket = MIN(bucket, PCIEMU_STATS_LAT_BUCKETS - 1);
+
+	stat64_add(&dev->stats.lat[phase][dir][size][bucket], 1);
+}
+
+/* -----------------------------------------------------------------------------
+ *  Public
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_stats_mmio_read: Account a guest read of a BAR0 register
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @addr: address being accessed (relative to the Memory Region)
+ */
+void pciemu_stats_mmio_read(PCIEMUDevice *dev, hwaddr addr)
+{
+	hwaddr slot = PCIEMU_HW_REG_SLOT(addr);
+
+	if (slot < PCIEMU_STATS_MMIO_CNT)
+		stat64_add(&dev->stats.mmio_reads[slot], 1);
+}
+
+/**
+ * pciemu_stats_mmio_write: Account a guest write of a BAR0 register
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @addr: address being accessed (relative to the Memory Region)
+ */
+void pciemu_stats_mmio_write(PCIEMUDevice *dev, hwaddr addr)
+{
+	hwaddr slot = PCIEMU_HW_REG_SLOT(addr);
+
+	if (slot < PCIEMU_STATS_MMIO_CNT)
+		stat64_add(&dev->stats.mmio_writes[slot], 1);
+}
+
+/**
+ * pciemu_stats_dma: Account a finished DMA transfer
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @cmd: command (direction) of the transfer
+ * @len: number of bytes transferred
+ * @err: whether the transfer failed
+ */
+void pciemu_stats_dma(PCIEMUDevice *dev, dma_cmd_t cmd, dma_size_t len,
+		bool err)
+{
+	if (err) {
+		stat64_add(&dev->stats.dma_errors, 1);
+		return;
+	}
+
+	if (cmd == PCIEMU_HW_DMA_DIRECTION_TO_DEVICE)
+		stat64_add(&dev->stats.dma_bytes_to_device, len);
+	else if (cmd == PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE)
+		stat64_add(&dev->stats.dma_bytes_from_device, len);
+}
+
+/**
+ * pciemu_stats_proxy_queue: Track the depth of the proxy request queue
+ *
+ * Called by the vCPU threads (push) and by the proxy thread (pop).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @delta: +1 on push, -1 on pop
+ */
+void pciemu_stats_proxy_queue(PCIEMUDevice *dev, int delta)
+{
+	uint32_t depth;
+
+	depth = qatomic_add_fetch(&dev->stats.proxy_queue_depth, delta);
+	if (delta > 0)
+		stat64_max(&dev->stats.proxy_queue_hwm, depth);
+}
+
+/**
+ * pciemu_stats_lat_stamp: Timestamp a point in the life of a DMA transfer
+ *
+ * A doorbell starts a new transfer, every following stamp closes the phase
+ * that started at the previous one. Stamps out of order (e.g. an IRQ lower
+ * with no DMA in flight) are ignored.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @stamp: point being reached
+ */
+void pciemu_stats_lat_stamp(PCIEMUDevice *dev, PCIEMUStatsLatStamp stamp)
+{
+	PCIEMUStatsLatTx *tx = &dev->stats.lat_tx;
+	int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+	if (stamp == PCIEMU_STATS_LAT_DOORBELL) {
+		memset(tx, 0, sizeof(*tx));
+		tx->stamp[stamp] = now;
+		return;
+	}
+
+	if (!tx->stamp[stamp - 1] || tx->stamp[stamp])
+		return;
+	tx->stamp[stamp] = now;
+
+	switch (stamp) {
+	case PCIEMU_STATS_LAT_EXEC_START:
+		tx->cmd = dev->dma.config.cmd;
+		tx->len = MIN(dev->dma.config.txdesc.len, PCIEMU_HW_DMA_AREA_SIZE);
+		pciemu_stats_lat_record(dev, PCIEMU_STATS_LAT_QUEUE,
+				PCIEMU_STATS_LAT_DOORBELL, stamp);
+		break;
+	case PCIEMU_STATS_LAT_EXEC_END:
+		pciemu_stats_lat_record(dev, PCIEMU_STATS_LAT_EXEC,
+				PCIEMU_STATS_LAT_EXEC_START, stamp);
+		break;
+	case PCIEMU_STATS_LAT_IRQ_RAISE:
+		pciemu_stats_lat_record(dev, PCIEMU_STATS_LAT_NOTIFY,
+				PCIEMU_STATS_LAT_EXEC_END, stamp);
+		break;
+	case PCIEMU_STATS_LAT_IRQ_LOWER:
+		pciemu_stats_lat_record(dev, PCIEMU_STATS_LAT_GUEST,
+				PCIEMU_STATS_LAT_IRQ_RAISE, stamp);
+		pciemu_stats_lat_record(dev, PCIEMU_STATS_LAT_TOTAL,
+				PCIEMU_STATS_LAT_DOORBELL, stamp);
+		memset(tx, 0, sizeof(*tx));
+		break;
+	default:
+		break;
+	}
+}
+
+/* visits one histogram as a list of buckets */
+static bool pciemu_stats_visit_hist(Visitor *v, const char *name,
+		Stat64 *hist, Error **errp)
+{
+	bool ok = true;
+	uint64_t val;
+
+	if (!visit_start_list(v, name, NULL, 0, errp))
+		return false;
+	for (int i = 0; ok && i < PCIEMU_STATS_LAT_BUCKETS; ++i) {
+		val = stat64_get(&hist[i]);
+		ok = visit_type_uint64(v, NULL, &val, errp);
+	}
+	if (ok)
+		ok = visit_check_list(v, errp);
+	visit_end_list(v, NULL);
+	return ok;
+}
+
+/* visits the histograms of one direction, one per size class */
+static bool pciemu_stats_visit_dir(Visitor *v, const char *name,
+		Stat64 (*hist)[PCIEMU_STATS_LAT_BUCKETS], Error **errp)
+{
+	bool ok = true;
+
+	if (!visit_start_struct(v, name, NULL, 0, errp))
+		return false;
+	for (int size = 0; ok && size < PCIEMU_STATS_LAT_SIZES; ++size)
+		ok = pciemu_stats_visit_hist(v, pciemu_stats_lat_size_name[size],
+				hist[size], errp);
+	if (ok)
+		ok = visit_check_struct(v, errp);
+	visit_end_struct(v, NULL);
+	return ok;
+}
+
+/**
+ * pciemu_stats_get_latency: QOM getter of the dma-latency-* properties
+ *
+ * Visits the histograms of one phase as
+ *   { "to-device": { "64": [ bucket0, ..., bucket31 ], ... },
+ *     "from-device": { ... } }
+ * where bucket n counts the transfers that took [2^n, 2^(n+1)) ns.
+ * Every visit_start_* is matched by its visit_end_*, also on errors.
+ *
+ * @obj: Instance of PCIEMUDevice object being used
+ * @v: visitor
+ * @name: property name
+ * @opaque: phase (PCIEMUStatsLatPhase)
+ * @errp: pointer to indicate errors
+ */
+void pciemu_stats_get_latency(Object *obj, Visitor *v, const char *name,
+		void *opaque, Error **errp)
+{
+	PCIEMUDevice *dev = PCIEMU(obj);
+	PCIEMUStatsLatPhase phase = (uintptr_t)opaque;
+	bool ok = true;
+
+	if (!visit_start_struct(v, name, NULL, 0, errp))
+		return;
+	for (int dir = 0; ok && dir < PCIEMU_STATS_LAT_DIRS; ++dir)
+		ok = pciemu_stats_visit_dir(v, pciemu_stats_lat_dir_name[dir],
+				dev->stats.lat[phase][dir], errp);
+	if (ok)
+		visit_check_struct(v, errp);
+	visit_end_struct(v, NULL);
+}
+
+/**
+ * pciemu_stats_init: Counters initialization
+ *
+ * @dev: Instance of PCIEMUDevice object being initialized
+ * @errp: pointer to indicate errors
+ */
+void pciemu_stats_init(PCIEMUDevice *dev, Error **errp)
+{
+	memset(&dev->stats, 0, sizeof(dev->stats));
+}
@@ -0,0 +1,114 @@
+/* stats.h - Device performance counters
+ *
+ * Counters are cumulative since the device was realized (a device reset
+ * does not clear them) and are exported through the query-pciemu QMP
+ * command and the "info pciemu" HMP command.
+ *
+ * DMA latency histograms are exported as QOM properties, one per phase
+ * of a transfer:
+ *   - dma-latency-queue  : doorbell pickup -> execution start. The
+ *                          doorbell is stamped when the device model gets
+ *                          it (from the ioeventfd in the main loop, or the
+ *                          vCPU write), so this is only the dispatch
+ *                          overhead (close to 0)
+ *   - dma-latency-exec   : execution start -> execution end
+ *   - dma-latency-notify : execution end -> IRQ raise
+ *   - dma-latency-guest  : IRQ raise -> IRQ lower (guest ACK)
+ *   - dma-latency-total  : doorbell -> IRQ lower
+ * Each one holds a log2(ns) histogram per direction and size class.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_STATS_H
+#define PCIEMU_STATS_H
+
+#include "qemu/osdep.h"
+#include "qemu/stats64.h"
+#include "exec/hwaddr.h"
+#include "qapi/visitor.h"
+#include "dma.h"
+#include "pciemu_hw.h"
+
+/* one counter per register slot of BAR0 (the regs page, RAM backed, is
+ * never counted) */
+#define PCIEMU_STATS_MMIO_CNT PCIEMU_HW_BAR0_REG_SLOTS
+
+/* DMA latency: bucket n counts latencies in [2^n, 2^(n+1)) ns */
+#define PCIEMU_STATS_LAT_BUCKETS 32
+#define PCIEMU_STATS_LAT_DIRS 2 /* to device, from device */
+#define PCIEMU_STATS_LAT_SIZES 4 /* <= 64, 256, 1024 bytes, larger */
+
+typedef enum PCIEMUStatsLatPhase {
+	PCIEMU_STATS_LAT_QUEUE,
+	PCIEMU_STATS_LAT_EXEC,
+	PCIEMU_STATS_LAT_NOTIFY,
+	PCIEMU_STATS_LAT_GUEST,
+	PCIEMU_STATS_LAT_TOTAL,
+	PCIEMU_STATS_LAT_PHASES,
+} PCIEMUStatsLatPhase;
+
+/* points in the life of a transfer where a timestamp is taken */
+typedef enum PCIEMUStatsLatStamp {
+	PCIEMU_STATS_LAT_DOORBELL,
+	PCIEMU_STATS_LAT_EXEC_START,
+	PCIEMU_STATS_LAT_EXEC_END,
+	PCIEMU_STATS_LAT_IRQ_RAISE,
+	PCIEMU_STATS_LAT_IRQ_LOWER,
+	PCIEMU_STATS_LAT_STAMPS,
+} PCIEMUStatsLatStamp;
+
+/* the transfer being timed (0 = stamp not taken yet) */
+typedef struct PCIEMUStatsLatTx {
+	int64_t stamp[PCIEMU_STATS_LAT_STAMPS];
+	dma_cmd_t cmd;
+	dma_size_t len;
+} PCIEMUStatsLatTx;
+
+/* forward declaration (defined in pciemu.h) to avoid circular reference */
+typedef struct PCIEMUDevice PCIEMUDevice;
+
+typedef struct PCIEMUStats {
+	/* MMIO */
+	Stat64 mmio_reads[PCIEMU_STATS_MMIO_CNT];
+	Stat64 mmio_writes[PCIEMU_STATS_MMIO_CNT];
+	Stat64 doorbells;
+	/* DMA */
+	Stat64 dma_bytes_to_device;
+	Stat64 dma_bytes_from_device;
+	Stat64 dma_errors;
+	/* IRQ */
+	Stat64 irqs_raised;
+	/* Proxy */
+	Stat64 proxy_msgs_sent;
+	Stat64 proxy_msgs_recv;
+	Stat64 proxy_bytes_sent;
+	Stat64 proxy_bytes_recv;
+	uint32_t proxy_queue_depth;
+	Stat64 proxy_queue_hwm;
+	/* DMA latency */
+	PCIEMUStatsLatTx lat_tx;
+	Stat64 lat[PCIEMU_STATS_LAT_PHASES][PCIEMU_STATS_LAT_DIRS]
+		[PCIEMU_STATS_LAT_SIZES][PCIEMU_STATS_LAT_BUCKETS];
+} PCIEMUStats;
+
+void pciemu_stats_mmio_read(PCIEMUDevice *dev, hwaddr addr);
+
+void pciemu_stats_mmio_write(PCIEMUDevice *dev, hwaddr addr);
+
+void pciemu_stats_dma(PCIEMUDevice *dev, dma_cmd_t cmd, dma_size_t len,
+		bool err);
+
+void pciemu_stats_proxy_queue(PCIEMUDevice *dev, int delta);
+
+void pciemu_stats_lat_stamp(PCIEMUDevice *dev, PCIEMUStatsLatStamp stamp);
+
+void pciemu_stats_get_latency(Object *obj, Visitor *v, const char *name,
+		void *opaque, Error **errp);
+
+void pciemu_stats_init(PCIEMUDevice *dev, Error **errp);
+
+#endif /* PCIEMU_STATS_H */
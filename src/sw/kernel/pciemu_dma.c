@@ -10,9 +10,16 @@
  */
 
 #include <linux/dma-mapping.h>
+#include <linux/io-64-nonatomic-lo-hi.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
 #include "pciemu_module.h"
+#include "pciemu_trace.h"
 #include "hw/pciemu_hw.h"
 
+/* How long remove waits for a DMA in flight */
+#define PCIEMU_DMA_DRAIN_TIMEOUT (HZ)
+
 static void pciemu_dma_struct_init(struct pciemu_dma *dma, size_t ofs,
 				size_t len, enum dma_data_direction drctn)
 {
@@ -21,57 +28,230 @@ static void pciemu_dma_struct_init(struct pciemu_dma *dma, size_t ofs,
 	dma->direction = drctn;
 }
 
-int pciemu_dma_from_host_to_device(struct pciemu_dev *pciemu_dev,
-				struct page *page, size_t ofs, size_t len)
+/* Wait until the channel of the queue is free and take ownership of it.
+ * The owner programs the channel registers without holding the lock; the
+ * IRQ handler releases the channel once the DMA has completed.
+ */
+static int pciemu_dma_queue_acquire(struct pciemu_queue *queue)
+{
+	int err;
+
+	spin_lock_irq(&queue->lock);
+	err = wait_event_interruptible_lock_irq(queue->wq, !queue->busy,
+						queue->lock);
+	if (!err)
+		queue->busy = true;
+	spin_unlock_irq(&queue->lock);
+	return err;
+}
+
+static void pciemu_dma_queue_release(struct pciemu_queue *queue)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->lock, flags);
+	queue->busy = false;
+	spin_unlock_irqrestore(&queue->lock, flags);
+	wake_up(&queue->wq);
+}
+
+/* Ring the doorbell of the DMA programmed on the queue. It is marked in
+ * flight first: the completion may be handled before iowrite32 returns.
+ */
+static void pciemu_dma_queue_ring(struct pciemu_queue *queue)
+{
+	/* traced before ringing: the DMA may complete (and the queue be
+	 * reused) before iowrite32 returns */
+	trace_pciemu_dma_doorbell(queue->dma.tag, queue->id, queue->dma.len,
+				  queue->dma.direction);
+	spin_lock_irq(&queue->lock);
+	queue->inflight = true;
+	spin_unlock_irq(&queue->lock);
+	iowrite32(1, queue->mmio + PCIEMU_HW_BAR0_DMA_DOORBELL_RING);
+}
+
+static int pciemu_dma_queue_map(struct pciemu_queue *queue, struct page *page,
+				size_t ofs, size_t len,
+				enum dma_data_direction drctn)
 {
-	struct pci_dev *pdev = pciemu_dev->pdev;
-	void __iomem *mmio = pciemu_dev->bar.mmio;
-	pciemu_dma_struct_init(&pciemu_dev->dma, ofs, len, DMA_TO_DEVICE);
-	pciemu_dev->dma.dma_handle = dma_map_page(&pdev->dev, page,
-			pciemu_dev->dma.offset, pciemu_dev->dma.len,
-			pciemu_dev->dma.direction);
-	if (dma_mapping_error(&(pdev->dev), pciemu_dev->dma.dma_handle))
+	struct pci_dev *pdev = queue->pciemu_dev->pdev;
+	u64 submitted = ktime_get_ns();
+	u32 tag = atomic_inc_return(&queue->pciemu_dev->tags);
+	int err;
+
+	trace_pciemu_dma_submit(tag, queue->id, len, drctn);
+	err = pciemu_dma_queue_acquire(queue);
+	if (err)
+		return err;
+	pciemu_dma_struct_init(&queue->dma, ofs, len, drctn);
+	queue->dma.page = page;
+	queue->dma.submitted = submitted;
+	queue->dma.tag = tag;
+	queue->dma.dma_handle = dma_map_page(&pdev->dev, page,
+			queue->dma.offset, queue->dma.len,
+			queue->dma.direction);
+	err = dma_mapping_error(&pdev->dev, queue->dma.dma_handle);
+	trace_pciemu_dma_map(tag, queue->id, len, drctn,
+			     queue->dma.dma_handle, err);
+	if (err) {
+		atomic64_inc(&queue->pciemu_dev->stats.map_errors);
+		pciemu_dma_queue_release(queue);
 		return -ENOMEM;
-	dev_dbg(&pdev->dev, "dma_handle_from = %llx\n",
-		(unsigned long long)pciemu_dev->dma.dma_handle);
-	dev_dbg(&pdev->dev, "cmd = %x\n", PCIEMU_HW_DMA_DIRECTION_TO_DEVICE);
-	iowrite32((u32)pciemu_dev->dma.dma_handle,
+	}
+	return 0;
+}
+
+int pciemu_dma_from_host_to_device(struct pciemu_queue *queue,
+				struct page *page, size_t ofs, size_t len)
+{
+	void __iomem *mmio = queue->mmio;
+	int err;
+
+	err = pciemu_dma_queue_map(queue, page, ofs, len, DMA_TO_DEVICE);
+	if (err)
+		return err;
+	/* every DMA register is 64-bit wide: a 32-bit write would keep a
+	 * stale upper half. writeq falls back to lo_hi_writeq on 32-bit */
+	writeq(queue->dma.dma_handle,
 		mmio + PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC);
-	iowrite32(PCIEMU_HW_DMA_AREA_START,
+	writeq(PCIEMU_HW_DMA_AREA_START,
 		mmio + PCIEMU_HW_BAR0_DMA_CFG_TXDESC_DST);
-	iowrite32(pciemu_dev->dma.len,
+	writeq(queue->dma.len,
 		mmio + PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN);
-	iowrite32(PCIEMU_HW_DMA_DIRECTION_TO_DEVICE,
+	writeq(PCIEMU_HW_DMA_DIRECTION_TO_DEVICE,
 		mmio + PCIEMU_HW_BAR0_DMA_CFG_CMD);
-	iowrite32(1, mmio + PCIEMU_HW_BAR0_DMA_DOORBELL_RING);
-	dev_dbg(&pdev->dev, "done host->device...\n");
+	pciemu_dma_queue_ring(queue);
 	return 0;
 }
 
-int pciemu_dma_from_device_to_host(struct pciemu_dev *pciemu_dev,
+int pciemu_dma_from_device_to_host(struct pciemu_queue *queue,
 				struct page *page, size_t ofs, size_t len)
 {
-	struct pci_dev *pdev = pciemu_dev->pdev;
-	void __iomem *mmio = pciemu_dev->bar.mmio;
-	pciemu_dma_struct_init(&pciemu_dev->dma, ofs, len, DMA_FROM_DEVICE);
-	pciemu_dev->dma.dma_handle = dma_map_page(&pdev->dev, page,
-			pciemu_dev->dma.offset, pciemu_dev->dma.len,
-			pciemu_dev->dma.direction);
-	if (dma_mapping_error(&(pdev->dev), pciemu_dev->dma.dma_handle))
-		return -ENOMEM;
-	dev_dbg(&(pdev->dev), "dma_handle_to = %llx\n",
-		(unsigned long long)pciemu_dev->dma.dma_handle);
-	dev_dbg(&(pdev->dev), "cmd = %x\n",
-		PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE);
-	iowrite32(PCIEMU_HW_DMA_AREA_START,
+	void __iomem *mmio = queue->mmio;
+	int err;
+
+	err = pciemu_dma_queue_map(queue, page, ofs, len, DMA_FROM_DEVICE);
+	if (err)
+		return err;
+	/* every DMA register is 64-bit wide: a 32-bit write would keep a
+	 * stale upper half. writeq falls back to lo_hi_writeq on 32-bit */
+	writeq(PCIEMU_HW_DMA_AREA_START,
 		mmio + PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC);
-	iowrite32((u32)pciemu_dev->dma.dma_handle,
+	writeq(queue->dma.dma_handle,
 		mmio + PCIEMU_HW_BAR0_DMA_CFG_TXDESC_DST);
-	iowrite32(pciemu_dev->dma.len,
+	writeq(queue->dma.len,
 		mmio + PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN);
-	iowrite32(PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE,
+	writeq(PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE,
 		mmio + PCIEMU_HW_BAR0_DMA_CFG_CMD);
-	iowrite32(1, mmio + PCIEMU_HW_BAR0_DMA_DOORBELL_RING);
-	dev_dbg(&(pdev->dev), "done device->host...\n\n");
+	pciemu_dma_queue_ring(queue);
 	return 0;
 }
+
+/* Take the DMA in flight on the queue, if any, for completion. Returns false
+ * when there is none: the interrupt is not a completion of this queue.
+ */
+bool pciemu_dma_queue_claim(struct pciemu_queue *queue)
+{
+	unsigned long flags;
+	bool inflight;
+
+	spin_lock_irqsave(&queue->lock, flags);
+	inflight = queue->busy && queue->inflight;
+	queue->inflight = false;
+	spin_unlock_irqrestore(&queue->lock, flags);
+	return inflight;
+}
+
+/* Complete the DMA claimed on the queue (called from the IRQ handler) */
+void pciemu_dma_queue_complete(struct pciemu_queue *queue)
+{
+	struct pci_dev *pdev = queue->pciemu_dev->pdev;
+	struct pciemu_dma *dma = &queue->dma;
+
+	dma_unmap_page(&pdev->dev, dma->dma_handle, dma->len, dma->direction);
+	trace_pciemu_dma_unmap(dma->tag, queue->id, dma->len, dma->direction);
+	unpin_user_page(dma->page);
+	trace_pciemu_dma_unpin(dma->tag, queue->id, dma->len, dma->direction);
+	pciemu_stats_complete(queue->pciemu_dev, &queue->dma);
+	pciemu_dma_queue_release(queue);
+}
+
+/* Select the submission queue of the calling CPU. Being migrated right after
+ * the lookup is harmless: the queue lock serializes submitters anyway.
+ */
+struct pciemu_queue *pciemu_dma_queue_get(struct pciemu_dev *pciemu_dev)
+{
+	unsigned int cpu = raw_smp_processor_id();
+
+	return &pciemu_dev->queues[cpu % pciemu_dev->nr_queues];
+}
+
+int pciemu_dma_queues_init(struct pciemu_dev *pciemu_dev)
+{
+	struct pciemu_queue *queue;
+	unsigned int i;
+
+	pciemu_dev->nr_queues = min_t(unsigned int, num_online_cpus(),
+				      PCIEMU_HW_DMA_CHAN_CNT);
+	pciemu_dev->queues = kcalloc(pciemu_dev->nr_queues,
+				     sizeof(*pciemu_dev->queues), GFP_KERNEL);
+	if (!pciemu_dev->queues)
+		return -ENOMEM;
+	atomic_set(&pciemu_dev->tags, 0);
+
+	for (i = 0; i < pciemu_dev->nr_queues; ++i) {
+		queue = &pciemu_dev->queues[i];
+		if (!zalloc_cpumask_var(&queue->affinity, GFP_KERNEL))
+			goto err_cpumask;
+		queue->pciemu_dev = pciemu_dev;
+		queue->id = i;
+		queue->irq_num = -1;
+		/* only one channel: every queue drives the BAR0 DMA registers */
+		queue->mmio = pciemu_dev->bar.mmio;
+		spin_lock_init(&queue->lock);
+		init_waitqueue_head(&queue->wq);
+	}
+	return 0;
+
+err_cpumask:
+	while (i--)
+		free_cpumask_var(pciemu_dev->queues[i].affinity);
+	kfree(pciemu_dev->queues);
+	pciemu_dev->queues = NULL;
+	return -ENOMEM;
+}
+
+/* Wait (a bounded time) for the DMAs in flight to complete. Called with the
+ * IRQs still enabled, before the device goes away.
+ */
+void pciemu_dma_queues_drain(struct pciemu_dev *pciemu_dev)
+{
+	struct pciemu_queue *queue;
+	unsigned int i;
+
+	for (i = 0; i < pciemu_dev->nr_queues; ++i) {
+		queue = &pciemu_dev->queues[i];
+		if (!wait_event_timeout(queue->wq, !READ_ONCE(queue->busy),
+					PCIEMU_DMA_DRAIN_TIMEOUT))
+			dev_warn(&pciemu_dev->pdev->dev,
+				 "queue %u: DMA did not complete\n", i);
+	}
+}
+
+void pciemu_dma_queues_fini(struct pciemu_dev *pciemu_dev)
+{
+	struct pciemu_queue *queue;
+	unsigned int i;
+
+	if (!pciemu_dev->queues)
+		return;
+	for (i = 0; i < pciemu_dev->nr_queues; ++i) {
+		queue = &pciemu_dev->queues[i];
+		/* never completed by the device: unmap and unpin it here */
+		if (pciemu_dma_queue_claim(queue))
+			pciemu_dma_queue_complete(queue);
+		free_cpumask_var(queue->affinity);
+	}
+	kfree(pciemu_dev->queues);
+	pciemu_dev->queues = NULL;
+}
@@ -9,24 +9,94 @@
  */
 #include "hw/pciemu_hw.h"
 #include "pciemu_module.h"
+#include "pciemu_trace.h"
+#include "sw/module/pciemu_ioctl.h"
+#include <linux/eventfd.h>
+#include <linux/interrupt.h>
 #include <linux/pci.h>
+#include <linux/version.h>
+
+static void pciemu_irq_eventfd_signal(struct pciemu_queue *queue)
+{
+	spin_lock(&queue->lock);
+	if (queue->eventfd)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+		eventfd_signal(queue->eventfd);
+#else
+		eventfd_signal(queue->eventfd, 1);
+#endif
+	spin_unlock(&queue->lock);
+}
+
+/* Replace the eventfd of the queue, dropping the previous one (if any).
+ * owner is the open file the binding belongs to.
+ */
+static void pciemu_irq_eventfd_set(struct pciemu_queue *queue,
+				   struct eventfd_ctx *ctx, struct file *owner)
+{
+	struct eventfd_ctx *old;
+
+	spin_lock_irq(&queue->lock);
+	old = queue->eventfd;
+	queue->eventfd = ctx;
+	queue->eventfd_owner = ctx ? owner : NULL;
+	spin_unlock_irq(&queue->lock);
+	if (old)
+		eventfd_ctx_put(old);
+}
 
 static irqreturn_t pciemu_irq_handler(int irq, void *data)
 {
-	struct pciemu_dev *pciemu_dev = data;
+	struct pciemu_queue *queue = data;
+	struct pciemu_dev *pciemu_dev = queue->pciemu_dev;
 
-	dev_dbg(&pciemu_dev->pdev->dev, "irq_handler irq = %d dev = %d\n", irq,
-		pciemu_dev->major);
+	/* shared INTx line, spurious interrupt or raised by hand: nothing
+	 * is in flight, so there is nothing to unmap and release */
+	if (!pciemu_dma_queue_claim(queue))
+		return IRQ_NONE;
 
-	dma_unmap_page((&pciemu_dev->pdev->dev), pciemu_dev->dma.dma_handle,
-		       pciemu_dev->dma.len, pciemu_dev->dma.direction);
+	trace_pciemu_irq(queue->dma.tag, queue->id, queue->dma.len,
+			 queue->dma.direction);
+	atomic64_inc(&pciemu_dev->stats.irqs);
 
-	unpin_user_page(pciemu_dev->dma.page);
-	/* Must do this ACK, or else the interrupt just keeps firing. */
+	/* Must do this ACK, or else the interrupt just keeps firing.
+	 * ACK before releasing the queue so that it cannot lower the
+	 * completion of the next DMA submitted on the channel.
+	 */
 	iowrite32(1, pciemu_dev->irq.mmio_ack_irq);
+	pciemu_dma_queue_complete(queue);
+	pciemu_irq_eventfd_signal(queue);
 	return IRQ_HANDLED;
 }
 
+/* Route the completion vector of each queue to the CPUs submitting to it,
+ * so that completions are handled on the cache of the submitting core.
+ */
+static void pciemu_irq_set_affinity(struct pciemu_dev *pciemu_dev)
+{
+	struct pciemu_queue *queue;
+	unsigned int cpu;
+
+	for_each_online_cpu(cpu) {
+		queue = &pciemu_dev->queues[cpu % pciemu_dev->nr_queues];
+		cpumask_set_cpu(cpu, queue->affinity);
+	}
+}
+
+static void pciemu_irq_free_queues(struct pciemu_dev *pciemu_dev,
+				   unsigned int count)
+{
+	struct pciemu_queue *queue;
+	unsigned int i;
+
+	for (i = 0; i < count; ++i) {
+		queue = &pciemu_dev->queues[i];
+		irq_update_affinity_hint(queue->irq_num, NULL);
+		free_irq(queue->irq_num, queue);
+		queue->irq_num = -1;
+	}
+}
+
 /* static int pciemu_irq_enable_intx(struct pciemu_dev *pciemu_dev) */
 /* { */
 /* 	int err; */
@@ -47,15 +117,17 @@ static irqreturn_t pciemu_irq_handler(int irq, void *data)
 
 static int pciemu_irq_enable_msi(struct pciemu_dev *pciemu_dev)
 {
+	struct pciemu_queue *queue;
 	int msi_vecs_req;
 	int msi_vecs;
+	unsigned int i;
 	int err;
 
 	/*
-	 * Reserve the max msi vectors we might need
+	 * Reserve one vector per submission queue
 	 */
 	msi_vecs_req = min_t(int, pci_msi_vec_count(pciemu_dev->pdev),
-			     num_online_cpus() + 1);
+			     pciemu_dev->nr_queues);
 	dev_dbg(&pciemu_dev->pdev->dev,
 		"Trying to enable MSI, requesting %d vectors\n", msi_vecs_req);
 
@@ -68,37 +140,48 @@ static int pciemu_irq_enable_msi(struct pciemu_dev *pciemu_dev)
 		return -ENOSPC;
 	}
 
-	if (msi_vecs != msi_vecs_req) {
-		pci_free_irq_vectors(pciemu_dev->pdev);
-		dev_err(&pciemu_dev->pdev->dev,
-			"allocated %d MSI (out of %d requested)\n", msi_vecs,
-			msi_vecs_req);
-		return -ENOSPC;
-	}
+	/* Fewer vectors than requested: fold the queues onto the vectors */
+	if (msi_vecs != msi_vecs_req)
+		dev_info(&pciemu_dev->pdev->dev,
+			 "allocated %d MSI (out of %d requested)\n", msi_vecs,
+			 msi_vecs_req);
+	pciemu_dev->irq.nr_vecs = msi_vecs;
+	pciemu_dev->irq.mmio_ack_irq =
+		pciemu_dev->bar.mmio + PCIEMU_HW_IRQ_DMA_ACK_ADDR;
+	pciemu_dev->nr_queues = min_t(unsigned int, pciemu_dev->nr_queues,
+				      msi_vecs);
+	pciemu_irq_set_affinity(pciemu_dev);
 
-	pciemu_dev->irq.irq_num = pci_irq_vector(
-		pciemu_dev->pdev, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR);
-	if (pciemu_dev->irq.irq_num < 0) {
-		pci_free_irq_vectors(pciemu_dev->pdev);
-		dev_err(&pciemu_dev->pdev->dev, "vector %d out of range\n",
-			PCIEMU_HW_IRQ_DMA_ENDED_VECTOR);
-		return -EINVAL;
-	}
+	for (i = 0; i < pciemu_dev->nr_queues; ++i) {
+		queue = &pciemu_dev->queues[i];
+		queue->irq_num = pci_irq_vector(pciemu_dev->pdev,
+				PCIEMU_HW_IRQ_DMA_ENDED_VECTOR + i);
+		if (queue->irq_num < 0) {
+			dev_err(&pciemu_dev->pdev->dev,
+				"vector %d out of range\n",
+				PCIEMU_HW_IRQ_DMA_ENDED_VECTOR + i);
+			err = -EINVAL;
+			goto err_vector;
+		}
 
-	err = request_irq(pciemu_dev->irq.irq_num, pciemu_irq_handler,
-			  PCIEMU_HW_IRQ_DMA_ENDED_VECTOR,
-			  "pciemu_irq_dma_ended", pciemu_dev);
-	if (err) {
-		dev_err(&pciemu_dev->pdev->dev,
-			"failed to request irq %s (%d)\n",
-			"pciemu_irq_dma_ended", err);
-		pci_free_irq_vectors(pciemu_dev->pdev);
-		return err;
+		err = request_irq(queue->irq_num, pciemu_irq_handler, 0,
+				  "pciemu_irq_dma_ended", queue);
+		if (err) {
+			dev_err(&pciemu_dev->pdev->dev,
+				"failed to request irq %s (%d)\n",
+				"pciemu_irq_dma_ended", err);
+			goto err_vector;
+		}
+		irq_set_affinity_and_hint(queue->irq_num, queue->affinity);
 	}
 
-	pciemu_dev->irq.mmio_ack_irq =
-		pciemu_dev->bar.mmio + PCIEMU_HW_IRQ_DMA_ACK_ADDR;
 	return 0;
+
+err_vector:
+	queue->irq_num = -1;
+	pciemu_irq_free_queues(pciemu_dev, i);
+	pci_free_irq_vectors(pciemu_dev->pdev);
+	return err;
 }
 
 int pciemu_irq_enable(struct pciemu_dev *pciemu_dev)
@@ -110,3 +193,73 @@ int pciemu_irq_enable(struct pciemu_dev *pciemu_dev)
 	return pciemu_irq_enable_msi(pciemu_dev);
 	/* return pciemu_irq_enable_intx(pciemu_dev); */
 }
+
+void pciemu_irq_disable(struct pciemu_dev *pciemu_dev)
+{
+	unsigned int i;
+
+	pciemu_irq_free_queues(pciemu_dev, pciemu_dev->nr_queues);
+	pci_free_irq_vectors(pciemu_dev->pdev);
+	for (i = 0; i < pciemu_dev->nr_queues; ++i)
+		pciemu_irq_eventfd_set(&pciemu_dev->queues[i], NULL, NULL);
+}
+
+/* Bind (fd >= 0) or unbind (fd < 0) an eventfd to a completion vector, so
+ * that userspace can wait for DMA completions from its own event loop.
+ * The binding belongs to the open file fp and is dropped when it is
+ * released. Either every selected vector is bound or none is.
+ */
+int pciemu_irq_eventfd_bind(struct pciemu_dev *pciemu_dev, struct file *fp,
+			    unsigned int vector, int fd)
+{
+	struct eventfd_ctx *ctx[PCIEMU_HW_DMA_CHAN_CNT] = { NULL };
+	unsigned int first = vector;
+	unsigned int last = vector;
+	unsigned int i;
+	int err;
+
+	if (vector == PCIEMU_IOCTL_VECTOR_ALL) {
+		first = 0;
+		last = pciemu_dev->nr_queues - 1;
+	} else if (vector >= pciemu_dev->nr_queues) {
+		return -EINVAL;
+	}
+
+	/* one reference per queue, all taken before binding any */
+	for (i = first; fd >= 0 && i <= last; ++i) {
+		ctx[i] = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx[i])) {
+			err = PTR_ERR(ctx[i]);
+			while (i-- > first)
+				eventfd_ctx_put(ctx[i]);
+			return err;
+		}
+	}
+
+	for (i = first; i <= last; ++i)
+		pciemu_irq_eventfd_set(&pciemu_dev->queues[i], ctx[i], fp);
+	return 0;
+}
+
+/* Drop the eventfd bindings made through the open file fp */
+void pciemu_irq_eventfd_release(struct pciemu_dev *pciemu_dev,
+				struct file *fp)
+{
+	struct pciemu_queue *queue;
+	struct eventfd_ctx *ctx;
+	unsigned int i;
+
+	for (i = 0; i < pciemu_dev->nr_queues; ++i) {
+		queue = &pciemu_dev->queues[i];
+		spin_lock_irq(&queue->lock);
+		ctx = NULL;
+		if (queue->eventfd_owner == fp) {
+			ctx = queue->eventfd;
+			queue->eventfd = NULL;
+			queue->eventfd_owner = NULL;
+		}
+		spin_unlock_irq(&queue->lock);
+		if (ctx)
+			eventfd_ctx_put(ctx);
+	}
+}
@@ -9,8 +9,11 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/pci.h>
+#include <linux/uaccess.h>
 #include "hw/pciemu_hw.h"
 #include "pciemu_module.h"
+#define CREATE_TRACE_POINTS
+#include "pciemu_trace.h"
 #include "sw/module/pciemu_ioctl.h"
 
 MODULE_LICENSE("GPL");
@@ -27,69 +30,164 @@ static struct pci_device_id pciemu_id_tbl[] = {
 
 MODULE_DEVICE_TABLE(pci, pciemu_id_tbl);
 
+static struct pciemu_bar *pciemu_bar_get(struct pciemu_dev *pciemu_dev,
+					 unsigned int bar)
+{
+	switch (bar) {
+	case PCIEMU_HW_BAR0:
+		return &pciemu_dev->bar;
+	case PCIEMU_HW_BAR1:
+		return &pciemu_dev->mem;
+	default:
+		return NULL;
+	}
+}
+
 static int pciemu_open(struct inode *inode, struct file *fp)
 {
 	unsigned int bar = iminor(inode);
 	struct pciemu_dev *pciemu_dev =
 		container_of(inode->i_cdev, struct pciemu_dev, cdev);
-	/* Only BAR 0 operations */
-	if (bar != PCIEMU_HW_BAR0)
+	struct pciemu_bar *res = pciemu_bar_get(pciemu_dev, bar);
+	/* Only BAR 0 (registers) and BAR 1 (device memory) operations */
+	if (!res)
 		return -ENXIO;
-	if (pciemu_dev->bar.len == 0)
+	if (res->len == 0)
 		return -EIO;
+	down_read(&pciemu_dev->remove_lock);
+	if (pciemu_dev->removed) {
+		up_read(&pciemu_dev->remove_lock);
+		return -ENODEV;
+	}
+	up_read(&pciemu_dev->remove_lock);
 	fp->private_data = pciemu_dev;
 	return 0;
 }
 
-static int pciemu_mmap(struct file *fp, struct vm_area_struct *vma)
+static int pciemu_release(struct inode *inode, struct file *fp)
+{
+	struct pciemu_dev *pciemu_dev = fp->private_data;
+
+	/* completions must not signal an eventfd of a closed file; once
+	 * removed, the device has dropped every binding (and its queues) */
+	down_read(&pciemu_dev->remove_lock);
+	if (!pciemu_dev->removed)
+		pciemu_irq_eventfd_release(pciemu_dev, fp);
+	up_read(&pciemu_dev->remove_lock);
+	return 0;
+}
+
+static int pciemu_do_mmap(struct file *fp, struct vm_area_struct *vma)
 {
 	int ret = 0;
+	unsigned int bar = iminor(file_inode(fp));
 	struct pciemu_dev *pciemu_dev = fp->private_data;
-	unsigned long pfn = pciemu_dev->bar.start >> PAGE_SHIFT;
-	if (vma->vm_end - vma->vm_start > pciemu_dev->bar.len)
+	struct pciemu_bar *res = pciemu_bar_get(pciemu_dev, bar);
+	unsigned long pfn = res->start >> PAGE_SHIFT;
+	if (vma->vm_end - vma->vm_start > res->len)
 		return -EIO;
+	/* Only the general purpose registers page of BAR 0 is exposed:
+	 * the IRQ, DMA configuration and doorbell pages are driver only.
+	 * With host pages larger than a BAR 0 page, the registers page
+	 * cannot be mapped without the others, so BAR 0 is not mappable.
+	 */
+	if (bar == PCIEMU_HW_BAR0 && (PAGE_SIZE > PCIEMU_HW_BAR0_PAGE_SIZE ||
+			vma->vm_end - vma->vm_start > PCIEMU_HW_BAR0_PAGE_SIZE))
+		return -EPERM;
+	/* Registers have side effects and must not be merged or reordered,
+	 * while streaming stores to device memory can be combined in bursts.
+	 */
+	if (bar == PCIEMU_HW_BAR1)
+		vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+	else
+		vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
 	ret = io_remap_pfn_range(vma, vma->vm_start, pfn,
 			vma->vm_end - vma->vm_start, vma->vm_page_prot);
 	return ret;
 }
 
-static long pciemu_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
+static long pciemu_do_ioctl(struct file *fp, unsigned int cmd,
+			    unsigned long arg)
 {
 	struct pciemu_dev *pciemu_dev = fp->private_data;
+	struct pciemu_queue *queue;
+	struct pciemu_ioctl_eventfd efd;
+	struct page *page;
 	int pages_pinned = 0;
 	int pages_nb_req = 1;
+	int err = 0;
 	unsigned long __user vaddr = arg;
 	unsigned long ofs = vaddr & ~PAGE_MASK;
 	unsigned long len = ((ofs + sizeof(int)) > PAGE_SIZE) ?
 		(PAGE_SIZE - ofs) : sizeof(int);
 	dev_dbg(&pciemu_dev->pdev->dev, "pciemu_ioctl, cmd = %x, addr=%lx\n",
 		cmd, vaddr);
+	atomic64_inc(&pciemu_dev->stats.ioctls);
 	switch (cmd) {
 	case PCIEMU_IOCTL_DMA_TO_DEVICE:
 		pages_pinned = pin_user_pages_fast(vaddr, pages_nb_req,
-				FOLL_LONGTERM, &pciemu_dev->dma.page);
-		if (pages_pinned == pages_nb_req) {
-			pciemu_dma_from_host_to_device(pciemu_dev,
-					pciemu_dev->dma.page, ofs, len);
+				FOLL_LONGTERM, &page);
+		if (pages_pinned != pages_nb_req) {
+			atomic64_inc(&pciemu_dev->stats.pin_errors);
+			break;
 		}
+		atomic64_add(pages_pinned, &pciemu_dev->stats.pages_pinned);
+		queue = pciemu_dma_queue_get(pciemu_dev);
+		err = pciemu_dma_from_host_to_device(queue, page, ofs, len);
 		break;
 	case PCIEMU_IOCTL_DMA_FROM_DEVICE:
 		pages_pinned = pin_user_pages_fast(vaddr, pages_nb_req,
-				FOLL_LONGTERM, &pciemu_dev->dma.page);
-		if (pages_pinned == pages_nb_req) {
-			pciemu_dma_from_device_to_host(pciemu_dev,
-					pciemu_dev->dma.page, ofs, len);
+				FOLL_LONGTERM, &page);
+		if (pages_pinned != pages_nb_req) {
+			atomic64_inc(&pciemu_dev->stats.pin_errors);
+			break;
 		}
+		atomic64_add(pages_pinned, &pciemu_dev->stats.pages_pinned);
+		queue = pciemu_dma_queue_get(pciemu_dev);
+		err = pciemu_dma_from_device_to_host(queue, page, ofs, len);
 		break;
+	case PCIEMU_IOCTL_EVENTFD_BIND:
+		if (copy_from_user(&efd, (void __user *)arg, sizeof(efd)))
+			return -EFAULT;
+		return pciemu_irq_eventfd_bind(pciemu_dev, fp, efd.vector,
+					       efd.fd);
 	default:
 		return -ENOTTY;
 	}
-	return 0;
+	/* the page is unpinned by the IRQ handler once the DMA completes */
+	if (err)
+		unpin_user_page(page);
+	return err;
+}
+
+static int pciemu_mmap(struct file *fp, struct vm_area_struct *vma)
+{
+	struct pciemu_dev *pciemu_dev = fp->private_data;
+	int ret = -ENODEV;
+
+	down_read(&pciemu_dev->remove_lock);
+	if (!pciemu_dev->removed)
+		ret = pciemu_do_mmap(fp, vma);
+	up_read(&pciemu_dev->remove_lock);
+	return ret;
+}
+
+static long pciemu_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
+{
+	struct pciemu_dev *pciemu_dev = fp->private_data;
+	long ret = -ENODEV;
+
+	down_read(&pciemu_dev->remove_lock);
+	if (!pciemu_dev->removed)
+		ret = pciemu_do_ioctl(fp, cmd, arg);
+	up_read(&pciemu_dev->remove_lock);
+	return ret;
 }
 
 static const struct file_operations pciemu_fops = {
 	.owner = THIS_MODULE,
 	.open = pciemu_open,
+	.release = pciemu_release,
 	.mmap = pciemu_mmap,
 	.unlocked_ioctl = pciemu_ioctl,
 };
@@ -101,6 +199,9 @@ static void pciemu_dev_clean(struct pciemu_dev *pciemu_dev)
 	pciemu_dev->bar.len = 0;
 	if (pciemu_dev->bar.mmio)
 		pci_iounmap(pciemu_dev->pdev, pciemu_dev->bar.mmio);
+	pciemu_dev->mem.start = 0;
+	pciemu_dev->mem.end = 0;
+	pciemu_dev->mem.len = 0;
 }
 
 static int pciemu_dev_init(struct pciemu_dev *pciemu_dev, struct pci_dev *pdev)
@@ -118,19 +219,53 @@ static int pciemu_dev_init(struct pciemu_dev *pciemu_dev, struct pci_dev *pdev)
 		pciemu_dev_clean(pciemu_dev);
 		return -ENOMEM;
 	}
+
+	/* BAR 1 (device memory) is only mapped by userspace */
+	pciemu_dev->mem.start = pci_resource_start(pdev, PCIEMU_HW_BAR1);
+	pciemu_dev->mem.end = pci_resource_end(pdev, PCIEMU_HW_BAR1);
+	pciemu_dev->mem.len = pci_resource_len(pdev, PCIEMU_HW_BAR1);
+	pciemu_dev->mem.mmio = NULL;
 	pci_set_drvdata(pdev, pciemu_dev);
 	return 0;
 }
 
+/* destroy the /dev/ nodes of the first count BARs */
+static void pciemu_device_destroy(struct pciemu_dev *pciemu_dev,
+				  unsigned int count)
+{
+	unsigned int bar;
+
+	for (bar = PCIEMU_HW_BAR0; bar < count; ++bar)
+		device_destroy(pciemu_class, MKDEV(pciemu_dev->major,
+					pciemu_dev->minor + bar));
+}
+
+static void pciemu_dev_release(struct kobject *kobj)
+{
+	kfree(container_of(kobj, struct pciemu_dev, kobj));
+}
+
+static const struct kobj_type pciemu_dev_ktype = {
+	.release = pciemu_dev_release,
+};
+
 static struct pciemu_dev *pciemu_alloc_dev(void)
 {
-	return kmalloc(sizeof(struct pciemu_dev), GFP_KERNEL);
+	struct pciemu_dev *pciemu_dev;
+
+	pciemu_dev = kzalloc(sizeof(struct pciemu_dev), GFP_KERNEL);
+	if (pciemu_dev) {
+		kobject_init(&pciemu_dev->kobj, &pciemu_dev_ktype);
+		init_rwsem(&pciemu_dev->remove_lock);
+	}
+	return pciemu_dev;
 }
 
 static int pciemu_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 {
 	int err;
 	int mem_bars;
+	unsigned int bar;
 	struct pciemu_dev *pciemu_dev;
 	dev_t dev_num;
 	struct device *dev;
@@ -184,6 +319,28 @@ static int pciemu_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 		goto err_dev_init;
 	}
 
+	/* counters in sysfs (stats group) and latency histogram in debugfs */
+	err = pciemu_stats_init(pciemu_dev);
+	if (err) {
+		dev_err(&pdev->dev, "pciemu_stats_init failed\n");
+		goto err_stats_init;
+	}
+
+	/* one submission queue per DMA channel */
+	err = pciemu_dma_queues_init(pciemu_dev);
+	if (err) {
+		dev_err(&pdev->dev, "pciemu_dma_queues_init failed\n");
+		goto err_queues_init;
+	}
+
+	/* enable IRQs */
+	err = pciemu_irq_enable(pciemu_dev);
+	if (err) {
+		dev_err(&pdev->dev, "pciemu_irq_enable failed\n");
+		goto err_irq_enable;
+	}
+
+	/* the /dev/ nodes come last: userspace may use them right away */
 	/* Get device number range (base_minor = bar0 and count = nbr of bars)*/
 	err = alloc_chrdev_region(&dev_num, PCIEMU_HW_BAR0, PCIEMU_HW_BAR_CNT,
 			"pciemu");
@@ -198,6 +355,7 @@ static int pciemu_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 
 	/* connect cdev with file operations */
 	cdev_init(&pciemu_dev->cdev, &pciemu_fops);
+	cdev_set_parent(&pciemu_dev->cdev, &pciemu_dev->kobj);
 
 	/* add major/min range to cdev */
 	err = cdev_add(&pciemu_dev->cdev, MKDEV(pciemu_dev->major,
@@ -207,42 +365,47 @@ static int pciemu_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 		goto err_cdev_add;
 	}
 
-	/* create /dev/ node via udev */
-	dev = device_create(pciemu_class, &pdev->dev,
-			MKDEV(pciemu_dev->major, pciemu_dev->minor),
-			pciemu_dev, "d%xb%xd%xf%x_bar%u",
-			pci_domain_nr(pdev->bus), pdev->bus->number,
-			PCI_SLOT(pdev->devfn), PCI_FUNC(pdev->devfn),
-			PCIEMU_HW_BAR0);
-	if (IS_ERR(dev)) {
-		err = PTR_ERR(dev);
-		dev_err(&pdev->dev, "device_create failed\n");
-		goto err_device_create;
-	}
-
-	/* enable IRQs */
-	err = pciemu_irq_enable(pciemu_dev);
-	if (err) {
-		dev_err(&pdev->dev, "pciemu_irq_enable failed\n");
-		goto err_irq_enable;
+	/* create one /dev/ node per BAR via udev */
+	for (bar = PCIEMU_HW_BAR0; bar < PCIEMU_HW_BAR_CNT; ++bar) {
+		dev = device_create(pciemu_class, &pdev->dev,
+				MKDEV(pciemu_dev->major, pciemu_dev->minor + bar),
+				pciemu_dev, "d%xb%xd%xf%x_bar%u",
+				pci_domain_nr(pdev->bus), pdev->bus->number,
+				PCI_SLOT(pdev->devfn), PCI_FUNC(pdev->devfn),
+				bar);
+		if (IS_ERR(dev)) {
+			err = PTR_ERR(dev);
+			dev_err(&pdev->dev, "device_create failed\n");
+			pciemu_device_destroy(pciemu_dev, bar);
+			goto err_device_create;
+		}
 	}
 
-	dev_info(&pdev->dev, "pciemu probe - success\n");
+	dev_info(&pdev->dev, "pciemu probe - success (%u queues)\n",
+		 pciemu_dev->nr_queues);
 
 	return 0;
 
-err_irq_enable:
-	device_destroy(pciemu_class,
-		       MKDEV(pciemu_dev->major, pciemu_dev->minor));
-
 err_device_create:
 	cdev_del(&pciemu_dev->cdev);
+	down_write(&pciemu_dev->remove_lock);
+	pciemu_dev->removed = true;
+	up_write(&pciemu_dev->remove_lock);
 
 err_cdev_add:
 	unregister_chrdev_region(MKDEV(pciemu_dev->major, pciemu_dev->minor),
 			PCIEMU_HW_BAR_CNT);
 
 err_alloc_chrdev:
+	pciemu_irq_disable(pciemu_dev);
+
+err_irq_enable:
+	pciemu_dma_queues_fini(pciemu_dev);
+
+err_queues_init:
+	pciemu_stats_fini(pciemu_dev);
+
+err_stats_init:
 	pciemu_dev_clean(pciemu_dev);
 
 err_dev_init:
@@ -257,7 +420,7 @@ err_dma_set_mask:
 	pci_disable_device(pdev);
 
 err_pci_enable:
-	kfree(pciemu_dev);
+	kobject_put(&pciemu_dev->kobj);
 
 err_pciemu_alloc:
 	dev_err(&pdev->dev, "pciemu_probe failed with error=%d\n", err);
@@ -267,19 +430,25 @@ err_pciemu_alloc:
 static void pciemu_remove(struct pci_dev *pdev)
 {
 	struct pciemu_dev *pciemu_dev = pci_get_drvdata(pdev);
-	device_destroy(pciemu_class, MKDEV(pciemu_dev->major,
-				pciemu_dev->minor));
+	pciemu_device_destroy(pciemu_dev, PCIEMU_HW_BAR_CNT);
 	cdev_del(&pciemu_dev->cdev);
 	unregister_chrdev_region(MKDEV(pciemu_dev->major, pciemu_dev->minor),
 			PCIEMU_HW_BAR_CNT);
+	/* files still open only see -ENODEV from here on */
+	down_write(&pciemu_dev->remove_lock);
+	pciemu_dev->removed = true;
+	up_write(&pciemu_dev->remove_lock);
+	/* let DMAs in flight complete, so their pages are unpinned */
+	pciemu_dma_queues_drain(pciemu_dev);
+	pciemu_irq_disable(pciemu_dev);
+	pciemu_dma_queues_fini(pciemu_dev);
+	pciemu_stats_fini(pciemu_dev);
 	pciemu_dev_clean(pciemu_dev);
 	pci_clear_master(pdev);
-	free_irq(pciemu_dev->irq.irq_num, pciemu_dev);
-	/* pci_free_irq_vectors(pdev); */
 	pci_release_selected_regions(pdev, pci_select_bars(pdev,
 				IORESOURCE_MEM));
 	pci_disable_device(pdev);
-	kfree(pciemu_dev);
+	kobject_put(&pciemu_dev->kobj);
 	dev_info(&pdev->dev, "pciemu remove - success\n");
 }
 
@@ -293,6 +462,7 @@ static struct pci_driver pciemu_pci_driver = {
 static void pciemu_module_exit(void)
 {
 	pci_unregister_driver(&pciemu_pci_driver);
+	pciemu_stats_module_exit();
 	class_destroy(pciemu_class);
 	pr_debug("pciemu_module_exit finished successfully\n");
 }
@@ -315,6 +485,7 @@ static int __init pciemu_module_init(void)
 		return err;
 	}
 	pciemu_class->devnode = pciemu_devnode;
+	pciemu_stats_module_init();
 	err = pci_register_driver(&pciemu_pci_driver);
 	if (err) {
 		pr_err("pci_register_driver error\n");
@@ -323,6 +494,7 @@ static int __init pciemu_module_init(void)
 	pr_debug("pciemu_module_init finished successfully\n");
 	return 0;
 err_pci:
+	pciemu_stats_module_exit();
 	class_destroy(pciemu_class);
 	pr_err("pciemu_module_init failed with err=%d\n", err);
 	return err;
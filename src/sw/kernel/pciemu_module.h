@@ -11,9 +11,16 @@
 
 #include <linux/pci.h>
 #include <linux/cdev.h>
+#include <linux/atomic.h>
+#include <linux/cpumask.h>
+#include <linux/kobject.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 
 /* forward declaration */
 struct pciemu_dev;
+struct eventfd_ctx;
 
 struct pciemu_bar {
 	u64 start;
@@ -28,40 +35,129 @@ struct pciemu_dma {
 	size_t len;
 	enum dma_data_direction direction;
 	struct page *page;
+	/* submission time (ns), to measure the submit-to-IRQ latency */
+	u64 submitted;
+	/* identifies the request in the tracepoints (pciemu_trace.h) */
+	u32 tag;
+};
+
+/* A submission queue drives one DMA channel of the device. CPUs are spread
+ * over the queues (cpu % nr_queues) and each queue completes on its own
+ * vector, whose affinity matches the CPUs submitting to it.
+ */
+struct pciemu_queue {
+	struct pciemu_dev *pciemu_dev;
+	/* protects busy, owner of the channel registers and of dma, and
+	 * inflight, set once the doorbell of dma has been rung */
+	spinlock_t lock;
+	wait_queue_head_t wq;
+	bool busy;
+	bool inflight;
+	struct pciemu_dma dma;
+	/* signaled on completion, if bound by userspace through the open
+	 * file eventfd_owner (both protected by lock) */
+	struct eventfd_ctx *eventfd;
+	struct file *eventfd_owner;
+	void __iomem *mmio;
+	unsigned int id;
+	int irq_num;
+	cpumask_var_t affinity;
+};
+
+/* Submit-to-IRQ latency histogram: bucket n counts DMAs whose latency (ns)
+ * lies in [2^n, 2^(n+1)), the last bucket also holds anything slower.
+ */
+#define PCIEMU_STATS_LAT_BUCKETS 32
+
+struct pciemu_stats {
+	atomic64_t ioctls;
+	atomic64_t bytes_to_device;
+	atomic64_t bytes_from_device;
+	atomic64_t pages_pinned;
+	atomic64_t pin_errors;
+	atomic64_t map_errors;
+	atomic64_t irqs;
+	atomic64_t latency[PCIEMU_STATS_LAT_BUCKETS];
+	struct dentry *debugfs;
 };
 
 struct pciemu_irq {
 	void __iomem *mmio_ack_irq;
-	int irq_num;
+	int nr_vecs;
 };
 
 struct pciemu_dev {
 	struct pci_dev *pdev;
-	/* In this simple PCIe device, we only a single BAR (0)
+	/* BAR 0 holds the registers and is mapped inside the kernel module.
+	 * BAR 1 is the device memory, only exposed to userspace through mmap.
 	 * We could have an array of size PCI_STD_NUM_BARS to
 	 * hold information about all bars.
 	 */
 	struct pciemu_bar bar;
+	struct pciemu_bar mem;
 	/* Only one IRQ is used in this simple device :
 	 *  - IRQ to inform that DMA has finished
 	 * We could also have an array here to describe more IRQs
 	 */
 	struct pciemu_irq irq;
-
-	struct pciemu_dma dma;
+	/* One submission queue per DMA channel, selected by the calling CPU */
+	struct pciemu_queue *queues;
+	unsigned int nr_queues;
+	/* last tag given to a submitted DMA */
+	atomic_t tags;
+	/* driver counters, exported through sysfs and debugfs */
+	struct pciemu_stats stats;
 	dev_t minor;
 	dev_t major;
 	struct cdev cdev;
+	/* parent of cdev: open files pin cdev, which pins the struct, so it
+	 * outlives pciemu_remove until the last file is gone */
+	struct kobject kobj;
+	/* file operations hold it for reading while they use the device,
+	 * pciemu_remove takes it for writing to set removed */
+	struct rw_semaphore remove_lock;
+	bool removed;
 };
 
-int pciemu_dma_from_host_to_device(struct pciemu_dev *pciemu_dev,
+int pciemu_dma_queues_init(struct pciemu_dev *pciemu_dev);
+
+void pciemu_dma_queues_drain(struct pciemu_dev *pciemu_dev);
+
+void pciemu_dma_queues_fini(struct pciemu_dev *pciemu_dev);
+
+struct pciemu_queue *pciemu_dma_queue_get(struct pciemu_dev *pciemu_dev);
+
+bool pciemu_dma_queue_claim(struct pciemu_queue *queue);
+
+void pciemu_dma_queue_complete(struct pciemu_queue *queue);
+
+int pciemu_dma_from_host_to_device(struct pciemu_queue *queue,
 				   struct page *page, size_t offset,
 				   size_t size);
 
-int pciemu_dma_from_device_to_host(struct pciemu_dev *pciemu_dev,
+int pciemu_dma_from_device_to_host(struct pciemu_queue *queue,
 				   struct page *page, size_t offset,
 				   size_t size);
 
 int pciemu_irq_enable(struct pciemu_dev *pciemu_dev);
 
+void pciemu_irq_disable(struct pciemu_dev *pciemu_dev);
+
+int pciemu_irq_eventfd_bind(struct pciemu_dev *pciemu_dev, struct file *fp,
+			    unsigned int vector, int fd);
+
+void pciemu_irq_eventfd_release(struct pciemu_dev *pciemu_dev,
+				struct file *fp);
+
+void pciemu_stats_complete(struct pciemu_dev *pciemu_dev,
+			   struct pciemu_dma *dma);
+
+int pciemu_stats_init(struct pciemu_dev *pciemu_dev);
+
+void pciemu_stats_fini(struct pciemu_dev *pciemu_dev);
+
+void pciemu_stats_module_init(void);
+
+void pciemu_stats_module_exit(void);
+
 #endif /* _PCIEMU_MODULE_H_ */
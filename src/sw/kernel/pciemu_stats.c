@@ -0,0 +1,117 @@
+/* pciemu_stats.c - pciemu driver statistics
+ *
+ * Counters are kept per device and exported through sysfs, in the "stats"
+ * group of the PCI device. The submit-to-IRQ latency histogram is exported
+ * through debugfs (pciemu/<pci device>/latency).
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/seq_file.h>
+#include "pciemu_module.h"
+
+static struct dentry *pciemu_debugfs_root;
+
+#define PCIEMU_STATS_ATTR(_name)					\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct pciemu_dev *pciemu_dev = dev_get_drvdata(dev);		\
+	return sysfs_emit(buf, "%lld\n",				\
+			  atomic64_read(&pciemu_dev->stats._name));	\
+}									\
+static DEVICE_ATTR_RO(_name)
+
+PCIEMU_STATS_ATTR(ioctls);
+PCIEMU_STATS_ATTR(bytes_to_device);
+PCIEMU_STATS_ATTR(bytes_from_device);
+PCIEMU_STATS_ATTR(pages_pinned);
+PCIEMU_STATS_ATTR(pin_errors);
+PCIEMU_STATS_ATTR(map_errors);
+PCIEMU_STATS_ATTR(irqs);
+
+static struct attribute *pciemu_stats_attrs[] = {
+	&dev_attr_ioctls.attr,
+	&dev_attr_bytes_to_device.attr,
+	&dev_attr_bytes_from_device.attr,
+	&dev_attr_pages_pinned.attr,
+	&dev_attr_pin_errors.attr,
+	&dev_attr_map_errors.attr,
+	&dev_attr_irqs.attr,
+	NULL,
+};
+
+static const struct attribute_group pciemu_stats_group = {
+	.name = "stats",
+	.attrs = pciemu_stats_attrs,
+};
+
+static int pciemu_stats_latency_show(struct seq_file *s, void *unused)
+{
+	struct pciemu_dev *pciemu_dev = s->private;
+	unsigned int i;
+
+	seq_puts(s, "# latency_ns_from count\n");
+	for (i = 0; i < PCIEMU_STATS_LAT_BUCKETS; ++i)
+		seq_printf(s, "%llu %lld\n", 1ULL << i,
+			   atomic64_read(&pciemu_dev->stats.latency[i]));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pciemu_stats_latency);
+
+/* Account a completed DMA (called from the IRQ handler) */
+void pciemu_stats_complete(struct pciemu_dev *pciemu_dev,
+			   struct pciemu_dma *dma)
+{
+	struct pciemu_stats *stats = &pciemu_dev->stats;
+	u64 delta = ktime_get_ns() - dma->submitted;
+	unsigned int bucket = delta ? ilog2(delta) : 0;
+
+	if (bucket >= PCIEMU_STATS_LAT_BUCKETS)
+		bucket = PCIEMU_STATS_LAT_BUCKETS - 1;
+	atomic64_inc(&stats->latency[bucket]);
+
+	if (dma->direction == DMA_TO_DEVICE)
+		atomic64_add(dma->len, &stats->bytes_to_device);
+	else
+		atomic64_add(dma->len, &stats->bytes_from_device);
+}
+
+int pciemu_stats_init(struct pciemu_dev *pciemu_dev)
+{
+	struct pci_dev *pdev = pciemu_dev->pdev;
+	int err;
+
+	memset(&pciemu_dev->stats, 0, sizeof(pciemu_dev->stats));
+	err = sysfs_create_group(&pdev->dev.kobj, &pciemu_stats_group);
+	if (err)
+		return err;
+
+	/* debugfs is best effort, failures are ignored on purpose */
+	pciemu_dev->stats.debugfs = debugfs_create_dir(pci_name(pdev),
+						       pciemu_debugfs_root);
+	debugfs_create_file("latency", 0444, pciemu_dev->stats.debugfs,
+			    pciemu_dev, &pciemu_stats_latency_fops);
+	return 0;
+}
+
+void pciemu_stats_fini(struct pciemu_dev *pciemu_dev)
+{
+	debugfs_remove_recursive(pciemu_dev->stats.debugfs);
+	pciemu_dev->stats.debugfs = NULL;
+	sysfs_remove_group(&pciemu_dev->pdev->dev.kobj, &pciemu_stats_group);
+}
+
+void pciemu_stats_module_init(void)
+{
+	pciemu_debugfs_root = debugfs_create_dir("pciemu", NULL);
+}
+
+void pciemu_stats_module_exit(void)
+{
+	debugfs_remove_recursive(pciemu_debugfs_root);
+	pciemu_debugfs_root = NULL;
+}
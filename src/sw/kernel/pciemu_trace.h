@@ -0,0 +1,99 @@
+/* pciemu_trace.h - Tracepoints of the pciemu kernel module
+ *
+ * Every DMA gets a tag when it is submitted, so that the events of its
+ * lifecycle (submit, map, doorbell, irq, unmap, unpin) can be matched
+ * to compute per-request latency breakdowns with perf or ftrace, e.g. :
+ *    perf record -e 'pciemu:*' -a
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pciemu
+
+#if !defined(_PCIEMU_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _PCIEMU_TRACE_H_
+
+#include <linux/dma-direction.h>
+#include <linux/tracepoint.h>
+
+#define pciemu_trace_show_dir(dir)				\
+	__print_symbolic(dir,					\
+			 { DMA_TO_DEVICE, "to_device" },	\
+			 { DMA_FROM_DEVICE, "from_device" },	\
+			 { DMA_BIDIRECTIONAL, "bidirectional" })
+
+DECLARE_EVENT_CLASS(pciemu_dma_class,
+	TP_PROTO(u32 tag, unsigned int queue, size_t len, int dir),
+	TP_ARGS(tag, queue, len, dir),
+	TP_STRUCT__entry(
+		__field(u32, tag)
+		__field(unsigned int, queue)
+		__field(size_t, len)
+		__field(int, dir)
+	),
+	TP_fast_assign(
+		__entry->tag = tag;
+		__entry->queue = queue;
+		__entry->len = len;
+		__entry->dir = dir;
+	),
+	TP_printk("tag=%u queue=%u len=%zu dir=%s", __entry->tag,
+		  __entry->queue, __entry->len,
+		  pciemu_trace_show_dir(__entry->dir))
+);
+
+DEFINE_EVENT(pciemu_dma_class, pciemu_dma_submit,
+	TP_PROTO(u32 tag, unsigned int queue, size_t len, int dir),
+	TP_ARGS(tag, queue, len, dir));
+
+DEFINE_EVENT(pciemu_dma_class, pciemu_dma_doorbell,
+	TP_PROTO(u32 tag, unsigned int queue, size_t len, int dir),
+	TP_ARGS(tag, queue, len, dir));
+
+DEFINE_EVENT(pciemu_dma_class, pciemu_irq,
+	TP_PROTO(u32 tag, unsigned int queue, size_t len, int dir),
+	TP_ARGS(tag, queue, len, dir));
+
+DEFINE_EVENT(pciemu_dma_class, pciemu_dma_unmap,
+	TP_PROTO(u32 tag, unsigned int queue, size_t len, int dir),
+	TP_ARGS(tag, queue, len, dir));
+
+DEFINE_EVENT(pciemu_dma_class, pciemu_dma_unpin,
+	TP_PROTO(u32 tag, unsigned int queue, size_t len, int dir),
+	TP_ARGS(tag, queue, len, dir));
+
+TRACE_EVENT(pciemu_dma_map,
+	TP_PROTO(u32 tag, unsigned int queue, size_t len, int dir,
+		 u64 dma_handle, int err),
+	TP_ARGS(tag, queue, len, dir, dma_handle, err),
+	TP_STRUCT__entry(
+		__field(u32, tag)
+		__field(unsigned int, queue)
+		__field(size_t, len)
+		__field(int, dir)
+		__field(u64, dma_handle)
+		__field(int, err)
+	),
+	TP_fast_assign(
+		__entry->tag = tag;
+		__entry->queue = queue;
+		__entry->len = len;
+		__entry->dir = dir;
+		__entry->dma_handle = dma_handle;
+		__entry->err = err;
+	),
+	TP_printk("tag=%u queue=%u len=%zu dir=%s dma_handle=%llx err=%d",
+		  __entry->tag, __entry->queue, __entry->len,
+		  pciemu_trace_show_dir(__entry->dir), __entry->dma_handle,
+		  __entry->err)
+);
+
+#endif /* _PCIEMU_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pciemu_trace
+#include <trace/define_trace.h>
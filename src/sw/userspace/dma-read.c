@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -108,21 +110,58 @@ static int mmap_pciemu_bar(struct context *ctx)
 	return 0;
 }
 
+/* wait on an eventfd bound to the device until the DMA has completed */
+static int wait_dma_completion(int efd)
+{
+	struct pollfd pfd = { .fd = efd, .events = POLLIN };
+	uint64_t cnt;
+
+	if (poll(&pfd, 1, 1000) != 1) {
+		LOG_ERR("timeout waiting for DMA completion\n");
+		return -1;
+	}
+	if (read(efd, &cnt, sizeof(cnt)) != sizeof(cnt)) {
+		LOG_ERR("eventfd read failed\n");
+		return -1;
+	}
+	return 0;
+}
+
 /* uses the ioctl syscals to perform DMA */
 static int ioctl_pciemu(struct context *ctx)
 {
-	int var;
+	int var, efd, ret;
+	struct pciemu_ioctl_eventfd bind;
+
+	efd = eventfd(0, EFD_CLOEXEC);
+	if (efd == -1) {
+		LOG_ERR("eventfd failed\n");
+		return -1;
+	}
+	bind.fd = efd;
+	bind.vector = PCIEMU_IOCTL_VECTOR_ALL;
+	if (ioctl(ctx->fd, PCIEMU_IOCTL_EVENTFD_BIND, &bind)) {
+		LOG_ERR("ioctl eventfd bind failed\n");
+		close(efd);
+		return -1;
+	}
 
 	rand_init();
 	var = rand();
 	LOG("initial value: var = %d\n", var);
+	ret = -1;
 	if (ioctl(ctx->fd, PCIEMU_IOCTL_DMA_FROM_DEVICE, &var)) {
 		LOG_ERR("ioctl failed\n");
-		return -1;
+		goto out;
 	}
+	if (wait_dma_completion(efd))
+		goto out;
 	LOG("dma direction from device, var = %d\n", var);
+	ret = 0;
 
-	return 0;
+out:
+	close(efd);
+	return ret;
 }
 
 /* parse arguments, note that some members of ctx are unmutable */
@@ -31,11 +31,11 @@
 #define PCI_FUNCTION_NUMBER_INVALID (1 << 3)
 
 struct context {
-	uint64_t *virt_addr;     /* virtual @ of mmaped BAR 0  */
+	uint64_t *virt_addr;     /* virtual @ of mmaped BAR 0 regs page */
 	int fd;                  /* file descriptor of dev file*/
 	uint32_t pci_domain_nb;  /* PCI domain number of device (16 bits) */
 	uint16_t pci_bus_nb;     /* PCI bus number of device (8 bits)  */
-	uint16_t pci_hw_bar_len; /* length of mappable BAR 0   */
+	uint16_t pci_hw_bar_len; /* length of mappable BAR 0 (regs page) */
 	uint8_t pci_hw_regs_nb;  /* number of 64bit device registers */
 	uint8_t pci_device_nb;   /* PCI device number of device (5 bits) */
 	uint8_t pci_func_nb;     /* PCI function number of device (3 bits) */
@@ -88,7 +88,8 @@ static int open_pciemu_dev(struct context *ctx)
 	return ctx->fd;
 }
 
-/* mmap BAR0 of the pciemu device into virt_addr */
+/* mmap the general purpose registers page of BAR0 into virt_addr: the
+ * other pages of BAR0 (IRQ, DMA) are driver only */
 static int mmap_pciemu_bar(struct context *ctx)
 {
 	ctx->virt_addr = mmap(NULL, ctx->pci_hw_bar_len, PROT_READ | PROT_WRITE,
@@ -123,9 +124,7 @@ static struct context parse_args(int argc, char **argv)
 	ctx.pci_func_nb = 0;
 	/* get the number of registers directly from HW definitions */
 	ctx.pci_hw_regs_nb = PCIEMU_HW_BAR0_REG_CNT;
-	/* ctx.pci_hw_bar_len = ctx.pci_hw_regs_nb * sizeof(uint64_t); */
-	/* ctx.pci_hw_bar_len = PCIEMU_HW_BAR0_START - PCIEMU_HW_BAR0_END; */
-	ctx.pci_hw_bar_len = 10 * sizeof(uint64_t); // magic number
+	ctx.pci_hw_bar_len = PCIEMU_HW_BAR0_PAGE_SIZE;
 	ctx.verbosity = 0;
 
 	while ((op = getopt(argc, argv, "b:d:hr:s:v")) != -1) {
@@ -172,7 +171,6 @@ static struct context parse_args(int argc, char **argv)
 						ctx.pci_hw_regs_nb, PCIEMU_HW_BAR0_REG_CNT);
 				exit(-1);
 			}
-			ctx.pci_hw_bar_len = ctx.pci_hw_regs_nb * sizeof(uint64_t);
 			break;
 		case 's':
 			ctx.pci_device_nb = strtol(optarg, &endptr, 10);
@@ -224,10 +222,37 @@ static struct context parse_args(int argc, char **argv)
 	return ctx;
 }
 
+/* write a random value to each register and read it back */
+static int test_regs(struct context *ctx)
+{
+	volatile uint64_t *regs;
+	uint64_t val, got;
+	int i, errors = 0;
+
+	regs = ctx->virt_addr + PCIEMU_HW_BAR0_REG_0 / sizeof(uint64_t);
+	for (i = 0; i < ctx->pci_hw_regs_nb; i++) {
+		val = ((uint64_t)rand() << 32) | (uint64_t)rand();
+		regs[i] = val;
+		got = regs[i];
+		if (ctx->verbosity)
+			LOG("reg %d: wrote 0x%016lx read 0x%016lx\n", i,
+					(unsigned long)val, (unsigned long)got);
+		if (got != val) {
+			LOG_ERR("reg %d: wrote 0x%016lx read 0x%016lx\n", i,
+					(unsigned long)val, (unsigned long)got);
+			errors++;
+		}
+	}
+
+	LOG("%d/%d registers ok\n", ctx->pci_hw_regs_nb - errors,
+			ctx->pci_hw_regs_nb);
+	return errors ? -1 : 0;
+}
+
 int main(int argc, char **argv)
 {
 	struct context ctx;
-	int ret, val;
+	int ret;
 
 	ctx = parse_args(argc, argv);
 
@@ -239,20 +264,12 @@ int main(int argc, char **argv)
 		goto err_mmap;
 
 	rand_init();
-	val = rand();
-	printf("val=%d\n", val);
-
-	ctx.virt_addr[PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC] = (uint64_t)&val;
-	ctx.virt_addr[PCIEMU_HW_BAR0_DMA_CFG_TXDESC_DST] =
-		PCIEMU_HW_DMA_AREA_START;
-	ctx.virt_addr[PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN] = sizeof(val);
-	ctx.virt_addr[PCIEMU_HW_BAR0_DMA_CFG_CMD] =
-		PCIEMU_HW_DMA_DIRECTION_TO_DEVICE;
-	ctx.virt_addr[PCIEMU_HW_BAR0_DMA_DOORBELL_RING] = 1;
+	ret = test_regs(&ctx);
 
-err_open:
+	munmap(ctx.virt_addr, ctx.pci_hw_bar_len);
 err_mmap:
 	close(ctx.fd);
+err_open:
 	if (ret < 0)
 		return EXIT_FAILURE;
 	return EXIT_SUCCESS;
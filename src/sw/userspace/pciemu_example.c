@@ -6,6 +6,7 @@
  *  - mmaps the BAR0 to access the device registers
  *  - uses ioctl to DMA to and from its own virtual memory (which are pinned on
  *    the kernel module)
+ *  - waits for each DMA completion on an eventfd bound to the device
  *
  * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
  *
@@ -19,6 +20,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -45,9 +48,14 @@
 /* First invalid number (by definition PCI function numbers are 3 bits long) */
 #define PCI_FUNCTION_NUMBER_INVALID (1 << 3)
 
+/* How long to wait for a DMA completion before giving up (ms) */
+#define DMA_COMPLETION_TIMEOUT 1000
+
 struct context {
     uint64_t *virt_addr;     /* virtual @ of mmaped BAR 0  */
     int fd;                  /* file descriptor of dev file*/
+    int efd;                 /* eventfd signaled on DMA completion */
+    int epfd;                /* epoll instance waiting on efd */
     uint32_t pci_domain_nb;  /* PCI domain number of device (16 bits) */
     uint16_t pci_bus_nb;     /* PCI bus number of device (8 bits)  */
     uint16_t pci_hw_bar_len; /* length of mappable BAR 0   */
@@ -139,6 +147,67 @@ static int mmap_pciemu_bar(struct context *ctx)
     return 0;
 }
 
+/* bind an eventfd to all DMA completion vectors and register it in epoll */
+static int eventfd_pciemu(struct context *ctx)
+{
+    struct pciemu_ioctl_eventfd bind;
+    struct epoll_event ev;
+
+    ctx->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ctx->efd == -1) {
+        LOG_ERR("eventfd failed\n");
+        return -1;
+    }
+
+    bind.fd = ctx->efd;
+    bind.vector = PCIEMU_IOCTL_VECTOR_ALL;
+    if (ioctl(ctx->fd, PCIEMU_IOCTL_EVENTFD_BIND, &bind)) {
+        LOG_ERR("ioctl eventfd bind failed\n");
+        close(ctx->efd);
+        return -1;
+    }
+
+    ctx->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctx->epfd == -1) {
+        LOG_ERR("epoll_create1 failed\n");
+        close(ctx->efd);
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = ctx->efd;
+    if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, ctx->efd, &ev)) {
+        LOG_ERR("epoll_ctl failed\n");
+        close(ctx->epfd);
+        close(ctx->efd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* wait (without spinning) until the device signals a DMA completion */
+static int wait_dma_completion(struct context *ctx)
+{
+    struct epoll_event ev;
+    uint64_t cnt;
+
+    if (epoll_wait(ctx->epfd, &ev, 1, DMA_COMPLETION_TIMEOUT) != 1) {
+        LOG_ERR("timeout waiting for DMA completion\n");
+        return -1;
+    }
+
+    if (read(ctx->efd, &cnt, sizeof(cnt)) != sizeof(cnt)) {
+        LOG_ERR("eventfd read failed\n");
+        return -1;
+    }
+
+    if (ctx->verbosity)
+        LOG("%lu DMA completion(s)\n", cnt);
+
+    return 0;
+}
+
 /* uses the ioctl syscals to perform DMA :
  *     - value of 'a' is DMA'ed into device memory;
  *     - 'b' is the destination of the value DMA'ed from the device memory
@@ -157,12 +226,16 @@ static int ioctl_pciemu(struct context *ctx)
         LOG_ERR("ioctl failed\n");
         return -1;
     }
+    if (wait_dma_completion(ctx))
+        return -1;
 
     LOG("dma direction from device, b@ = %p b = %d\n", &b, b);
     if (ioctl(ctx->fd, PCIEMU_IOCTL_DMA_FROM_DEVICE, &b)) {
         LOG_ERR("ioctl failed\n");
         return -1;
     }
+    if (wait_dma_completion(ctx))
+        return -1;
 
     LOG("final values : a = %d b = %d\n", a, b);
     if (a != b) {
@@ -300,11 +373,20 @@ int main(int argc, char **argv)
     write_registers_sequential(&ctx);
     print_registers(&ctx, "current ");
 
+    if (eventfd_pciemu(&ctx)) {
+        close(ctx.fd);
+        return -1;
+    }
+
     if (ioctl_pciemu(&ctx)) {
+        close(ctx.epfd);
+        close(ctx.efd);
         close(ctx.fd);
         return -1;
     }
 
+    close(ctx.epfd);
+    close(ctx.efd);
     close(ctx.fd);
     return 0;
 }